@@ -0,0 +1,423 @@
+/*
+ * link_bench.c: runs a link program at a fixed concurrency and reports
+ *               its throughput, latency and memory use
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+/* Usage: link_bench [-c concurrency] [-n requests]
+ *                   [[-b bytes] [-s bytes] | -a] program [argument ...]
+ *
+ * Runs the program, vlink or tlink, as a web server would run a CGI
+ * program, keeping -c of them (8 by default) going until -n requests
+ * (1000 by default) have been made.  Each is given a POST body of -b
+ * bytes, or is a GET if that is 0, and asks link_bench_server for a
+ * page of -s bytes.  The body is written to the program, and the
+ * response read from it, through pipes, as a web server would.
+ *
+ * With -a, three runs are made instead of one given by -b and -s, for
+ * a GET of an 8KB page, a POST of a 4MB upload, and a GET of an 8MB
+ * page.
+ *
+ * For each run it reports the requests a second, the 50th, 90th and
+ * 99th percentile and the longest time taken by a request, and the
+ * largest resident set of any of the programs.  A request fails if
+ * the program exits with an error, or its response isn't a 200 saying
+ * that the server got the whole body, followed by a page of exactly
+ * the size asked for.
+ *
+ * MINIVEND_SOCKET or MINIVEND_PORT in the environment tell the program
+ * where link_bench_server is listening, as usual.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_CONCURRENCY 256
+#define HEAD_SIZE 512		/* enough for link_bench_server's headers */
+
+struct run {
+  char* name;
+  long body;			/* bytes of POST body, 0 for a GET */
+  long page;			/* bytes of response asked for */
+};
+
+/* A program running a request.
+ */
+struct slot {
+  pid_t pid;			/* 0 when free */
+  int in;			/* its stdin, -1 once the body is sent */
+  int out;			/* its stdout, -1 once at EOF */
+  long sent;			/* bytes of body written */
+  long got;			/* bytes of response read */
+  int head_len;
+  char head[HEAD_SIZE + 1];	/* the start of the response */
+  double start;
+};
+
+static char body[65536];	/* what POST bodies are made of */
+static char** program;
+
+static double now()
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int by_time(a, b)
+     const void* a;
+     const void* b;
+{
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Starts the program on a request in slot S.
+ */
+static void start(s, r)
+     struct slot* s;
+     struct run* r;
+{
+  char num[32];
+  int fds[2];
+  int body_fds[2];
+  int in;
+
+  if (pipe(fds) < 0 || (r->body > 0 && pipe(body_fds) < 0)) {
+    perror("link_bench: pipe");
+    exit(1);
+  }
+  s->start = now();
+  s->sent = 0;
+  s->got = 0;
+  s->head_len = 0;
+  s->pid = fork();
+  if (s->pid < 0) {
+    perror("link_bench: fork");
+    exit(1);
+  }
+  if (s->pid == 0) {
+    close(fds[0]);
+    dup2(fds[1], 1);
+    close(fds[1]);
+    if (r->body > 0) {
+      close(body_fds[1]);
+      dup2(body_fds[0], 0);
+      close(body_fds[0]);
+    }
+    else {
+      in = open("/dev/null", O_RDONLY);
+      dup2(in, 0);
+      close(in);
+    }
+
+    setenv("GATEWAY_INTERFACE", "CGI/1.1", 1);
+    setenv("SERVER_NAME", "localhost", 1);
+    setenv("SERVER_PORT", "80", 1);
+    setenv("SERVER_PROTOCOL", "HTTP/1.1", 1);
+    setenv("REMOTE_ADDR", "127.0.0.1", 1);
+    setenv("SCRIPT_NAME", "/cgi-bin/bench", 1);
+    setenv("PATH_INFO", "/index", 1);
+    setenv("REQUEST_URI", "/cgi-bin/bench/index", 1);
+    setenv("QUERY_STRING", "", 1);
+    setenv("HTTP_USER_AGENT", "link_bench", 1);
+    sprintf(num, "%ld", r->page);
+    setenv("HTTP_X_BENCH_SIZE", num, 1);
+    if (r->body > 0) {
+      setenv("REQUEST_METHOD", "POST", 1);
+      setenv("CONTENT_TYPE", "application/octet-stream", 1);
+      sprintf(num, "%ld", r->body);
+      setenv("CONTENT_LENGTH", num, 1);
+    }
+    else {
+      setenv("REQUEST_METHOD", "GET", 1);
+      unsetenv("CONTENT_TYPE");
+      unsetenv("CONTENT_LENGTH");
+    }
+    execv(program[0], program);
+    perror(program[0]);
+    _exit(127);
+  }
+  close(fds[1]);
+  s->out = fds[0];
+  s->in = -1;
+  if (r->body > 0) {
+    /* Written as the program reads it; the programs started later
+     * mustn't hold it open.
+     */
+    close(body_fds[0]);
+    fcntl(body_fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(body_fds[1], F_SETFD, FD_CLOEXEC);
+    s->in = body_fds[1];
+  }
+}
+
+/* Writes what the program in slot S will take of the rest of its body.
+ */
+static void send_body(s, r)
+     struct slot* s;
+     struct run* r;
+{
+  ssize_t n;
+  long left;
+
+  for (;;) {
+    left = r->body - s->sent;
+    n = write(s->in, body, left < (long) sizeof(body) ? (size_t) left : sizeof(body));
+    if (n > 0 && (s->sent += n) < r->body)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+    close(s->in);
+    s->in = -1;
+    return;
+  }
+}
+
+/* Counts N bytes of response read by slot S, keeping the start of it.
+ */
+static void take(s, data, n)
+     struct slot* s;
+     char* data;
+     ssize_t n;
+{
+  int k = HEAD_SIZE - s->head_len;
+
+  if (k > n)
+    k = n;
+  memcpy(s->head + s->head_len, data, k);
+  s->head_len += k;
+  s->got += n;
+}
+
+/* Did the program in slot S answer as link_bench_server does, with a
+ * 200, the size of the body it got, and then the page asked for in R?
+ */
+static int answered(s, r)
+     struct slot* s;
+     struct run* r;
+{
+  char* end;
+  char* p;
+  int status;
+
+  s->head[s->head_len] = '\0';
+  end = strstr(s->head, "\r\n\r\n");
+  if (end == 0 || sscanf(s->head, "Status: %d", &status) != 1
+      || status != 200)
+    return 0;
+  p = strstr(s->head, "\r\nX-Bench-Entity:");
+  if (p == 0 || p > end || strtol(p + 17, 0, 10) != r->body)
+    return 0;
+  return s->got - (end + 4 - s->head) == r->page;
+}
+
+/* Makes N requests of run R, C at a time, and reports on them.
+ */
+static void bench(r, n, c)
+     struct run* r;
+     int n;
+     int c;
+{
+  static char drain[65536];
+  struct slot slots[MAX_CONCURRENCY];
+  struct pollfd pfd[2 * MAX_CONCURRENCY];
+  int which[2 * MAX_CONCURRENCY];
+  struct rusage ru;
+  double* times;
+  double began, took;
+  long peak = 0;
+  int started = 0, done = 0, failed = 0, running = 0;
+  int status, i, k, np;
+  ssize_t got;
+  pid_t pid;
+
+  times = (double*) malloc(n * sizeof(double));
+  if (times == 0) {
+    fprintf(stderr, "link_bench: out of memory\n");
+    exit(1);
+  }
+  memset(slots, 0, sizeof(slots));
+
+  began = now();
+  while (done < n) {
+    for (i = 0; i < c && started < n; i++) {
+      if (slots[i].pid == 0) {
+        start(&slots[i], r);
+        started++;
+        running++;
+      }
+    }
+
+    /* Send the bodies and read the responses, then reap the programs
+     * that have finished.
+     */
+    for (i = np = 0; i < c; i++) {
+      if (slots[i].pid != 0 && slots[i].in >= 0) {
+        pfd[np].fd = slots[i].in;
+        pfd[np].events = POLLOUT;
+        which[np++] = i;
+      }
+      if (slots[i].pid != 0 && slots[i].out >= 0) {
+        pfd[np].fd = slots[i].out;
+        pfd[np].events = POLLIN;
+        which[np++] = i;
+      }
+    }
+    if (np > 0 && poll(pfd, np, 1000) > 0) {
+      for (k = 0; k < np; k++) {
+        if (!(pfd[k].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)))
+          continue;
+        i = which[k];
+        if (pfd[k].fd == slots[i].in) {
+          send_body(&slots[i], r);
+          continue;
+        }
+        got = read(slots[i].out, drain, sizeof(drain));
+        if (got > 0)
+          take(&slots[i], drain, got);
+        else if (got == 0 || errno != EINTR) {
+          close(slots[i].out);
+          slots[i].out = -1;
+        }
+      }
+    }
+
+    while (running > 0) {
+      /* Only wait once every response has been read, so a program is
+       * never left blocked on a full pipe.
+       */
+      for (i = 0; i < c; i++)
+        if (slots[i].pid != 0 && (slots[i].out >= 0 || slots[i].in >= 0))
+          break;
+      pid = wait4(-1, &status, i < c ? WNOHANG : 0, &ru);
+      if (pid <= 0)
+        break;
+      for (i = 0; i < c && slots[i].pid != pid; i++)
+        ;
+      if (i == c)
+        continue;
+      if (slots[i].in >= 0)
+        close(slots[i].in);
+      if (slots[i].out >= 0) {
+        while ((got = read(slots[i].out, drain, sizeof(drain))) > 0)
+          take(&slots[i], drain, got);
+        close(slots[i].out);
+      }
+      times[done++] = now() - slots[i].start;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0
+          || !answered(&slots[i], r))
+        failed++;
+      if (ru.ru_maxrss > peak)
+        peak = ru.ru_maxrss;
+      slots[i].pid = 0;
+      running--;
+    }
+  }
+  took = now() - began;
+
+  qsort(times, n, sizeof(double), by_time);
+  printf("%-12s %8d %6d %9.1f %8.2f %8.2f %8.2f %8.2f %10ld\n",
+         r->name, n, failed, n / took,
+         times[n / 2] * 1000, times[n * 90 / 100] * 1000,
+         times[n * 99 / 100] * 1000, times[n - 1] * 1000, peak);
+  fflush(stdout);
+  free(times);
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: link_bench [-c concurrency] [-n requests]"
+          " [[-b bytes] [-s bytes] | -a] program [argument ...]\n");
+  exit(2);
+}
+
+int main(argc, argv)
+     int argc;
+     char** argv;
+{
+  static struct run suite[] = {
+    { "get-8k", 0, 8192 },
+    { "post-4m", 4L << 20, 8192 },
+    { "get-8m", 0, 8L << 20 },
+  };
+  struct run one;
+  int concurrency = 8;
+  int requests = 1000;
+  int all = 0;
+  int one_set = 0;
+  int c, i;
+
+  one.name = "request";
+  one.body = 0;
+  one.page = 8192;
+  while ((c = getopt(argc, argv, "+c:n:b:s:a")) != -1) {
+    switch (c) {
+    case 'c':
+      concurrency = atoi(optarg);
+      break;
+    case 'n':
+      requests = atoi(optarg);
+      break;
+    case 'b':
+      one.body = atol(optarg);
+      one_set = 1;
+      break;
+    case 's':
+      one.page = atol(optarg);
+      one_set = 1;
+      break;
+    case 'a':
+      all = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind == argc || concurrency < 1 || concurrency > MAX_CONCURRENCY
+      || requests < 1 || (all && one_set))
+    usage();
+  program = argv + optind;
+  memset(body, 'b', sizeof(body));
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%-12s %8s %6s %9s %8s %8s %8s %8s %10s\n",
+         "run", "requests", "failed", "req/s",
+         "p50 ms", "p90 ms", "p99 ms", "max ms", "peak RSS K");
+  if (all)
+    for (i = 0; i < (int) (sizeof(suite) / sizeof(suite[0])); i++)
+      bench(&suite[i], requests, concurrency);
+  else
+    bench(&one, requests, concurrency);
+  return 0;
+}
@@ -0,0 +1,412 @@
+/*
+ * link_bench_server.c: stands in for an Interchange server, answering
+ *                      link requests with canned pages for benchmarks
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+/* Usage: link_bench_server [-u socket] [-p port] [-s bytes] [-l ms]
+ *
+ * Listens on a UNIX socket, a TCP port on 127.0.0.1, or both, and
+ * reads each request in the text (arg/env/entity/end) or binary link
+ * protocol, as vlink, tlink and mod_interchange send it.  After -l
+ * milliseconds, standing for the time Interchange takes to make a
+ * page, it answers with a page of -s bytes (8192 by default).  A
+ * request can ask for another size or latency with the X-Bench-Size
+ * and X-Bench-Delay headers, that is HTTP_X_BENCH_SIZE and
+ * HTTP_X_BENCH_DELAY in its environment.  The response says how much
+ * of a request body was received in an X-Bench-Entity header.
+ *
+ * Each connection is handled in a child process, as Interchange does,
+ * so that a slow page doesn't hold up the others.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#define BUF_SIZE 65536
+#define PREAMBLE "\0ICL\2"		/* starts a binary request */
+#define PREAMBLE_LEN 5
+
+static long page_size = 8192;	/* default response size */
+static long latency_ms = 0;	/* default time to make a page */
+
+/* Buffered reading of the request from the connection.
+ */
+static int conn;
+static char buf[BUF_SIZE];
+static int buf_pos;
+static int buf_len;
+
+static void die(msg)
+     char* msg;
+{
+  fprintf(stderr, "link_bench_server: %s\n", msg);
+  exit(1);
+}
+
+static int fill()
+{
+  int n;
+
+  do
+    n = read(conn, buf, sizeof(buf));
+  while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    die("request ended early");
+  buf_pos = 0;
+  buf_len = n;
+  return n;
+}
+
+static int get()
+{
+  if (buf_pos == buf_len)
+    fill();
+  return (unsigned char) buf[buf_pos++];
+}
+
+/* Reads N bytes of the request into TO, keeping at most MAX of them.
+ */
+static void get_n(to, n, max)
+     char* to;
+     unsigned long n;
+     unsigned long max;
+{
+  unsigned long k;
+
+  while (n > 0) {
+    if (buf_pos == buf_len)
+      fill();
+    k = buf_len - buf_pos;
+    if (k > n)
+      k = n;
+    if (max > 0) {
+      memcpy(to, buf + buf_pos, k < max ? k : max);
+      to += k < max ? k : max;
+      max -= k < max ? k : max;
+    }
+    buf_pos += k;
+    n -= k;
+  }
+}
+
+/* Reads a decimal number ended by DELIM.
+ */
+static unsigned long get_number(delim)
+     int delim;
+{
+  unsigned long n = 0;
+  int c;
+
+  while ((c = get()) != delim) {
+    if (c < '0' || c > '9')
+      die("bad number in request");
+    n = n * 10 + c - '0';
+  }
+  return n;
+}
+
+static unsigned long get_u32()
+{
+  unsigned long n;
+
+  n = (unsigned long) get() << 24;
+  n |= get() << 16;
+  n |= get() << 8;
+  n |= get();
+  return n;
+}
+
+/* Keeps what a request asks for from a variable of its environment,
+ * NAME=VALUE, LEN bytes long.
+ */
+static void note_env(var, len, size, delay)
+     char* var;
+     unsigned long len;
+     long* size;
+     long* delay;
+{
+  var[len] = '\0';
+  if (strncmp(var, "HTTP_X_BENCH_SIZE=", 18) == 0)
+    *size = atol(var + 18);
+  else if (strncmp(var, "HTTP_X_BENCH_DELAY=", 19) == 0)
+    *delay = atol(var + 19);
+}
+
+/* Reads a text request, setting what it asks for and the size of its
+ * body.
+ */
+static void read_text(size, delay, entity)
+     long* size;
+     long* delay;
+     unsigned long* entity;
+{
+  char word[16];
+  char var[256];
+  unsigned long count, len;
+  int c, i;
+
+  for (;;) {
+    for (i = 0; (c = get()) != '\n' && c != ' '; )
+      if (i < (int) sizeof(word) - 1)
+        word[i++] = c;
+    word[i] = '\0';
+
+    if (strcmp(word, "end") == 0)
+      return;
+    if (strcmp(word, "entity") == 0) {
+      len = get_number(' ');
+      get_n(0, len, 0);
+      *entity += len;
+      get();
+      continue;
+    }
+    if (strcmp(word, "arg") != 0 && strcmp(word, "env") != 0)
+      die("unknown block in request");
+
+    count = get_number('\n');
+    while (count-- > 0) {
+      len = get_number(' ');
+      get_n(var, len, sizeof(var) - 1);
+      if (word[1] == 'n' && len < sizeof(var))
+        note_env(var, len, size, delay);
+      get();
+    }
+  }
+}
+
+/* Reads the frames of a binary request, after its preamble.
+ */
+static void read_binary(size, delay, entity)
+     long* size;
+     long* delay;
+     unsigned long* entity;
+{
+  char var[256];
+  unsigned long len, name, value;
+  int type;
+
+  for (;;) {
+    type = get();
+    len = get_u32();
+    if (type == 'Z')
+      return;
+    if (type != 'E') {
+      get_n(0, len, 0);
+      if (type == 'B')
+        *entity += len;
+      continue;
+    }
+    while (len > 0) {
+      name = get_u32();
+      get_n(var, name, sizeof(var) - 1);
+      value = get_u32();
+      if (name + 1 + value < sizeof(var)) {
+        var[name] = '=';
+        get_n(var + name + 1, value, value);
+        note_env(var, name + 1 + value, size, delay);
+      }
+      else
+        get_n(0, value, 0);
+      len -= 8 + name + value;
+    }
+  }
+}
+
+static void write_all(data, len)
+     char* data;
+     unsigned long len;
+{
+  int n;
+
+  while (len > 0) {
+    n = write(conn, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      exit(1);
+    data += n;
+    len -= n;
+  }
+}
+
+/* Reads a request from the connection and answers it.
+ */
+static void serve()
+{
+  static char page[BUF_SIZE];
+  struct timespec ts;
+  char head[256];
+  long size = page_size;
+  long delay = latency_ms;
+  unsigned long entity = 0;
+  unsigned long n;
+
+  if (get() == PREAMBLE[0]) {
+    get_n(head, PREAMBLE_LEN - 1, PREAMBLE_LEN - 1);
+    if (memcmp(head, PREAMBLE + 1, PREAMBLE_LEN - 1) != 0)
+      die("bad preamble");
+    read_binary(&size, &delay, &entity);
+  }
+  else {
+    buf_pos--;
+    read_text(&size, &delay, &entity);
+  }
+
+  if (delay > 0) {
+    ts.tv_sec = delay / 1000;
+    ts.tv_nsec = (delay % 1000) * 1000000;
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+      ;
+  }
+
+  write_all(head, sprintf(head, "Status: 200 OK\r\n"
+                          "Content-Type: text/html\r\n"
+                          "Content-Length: %ld\r\n"
+                          "X-Bench-Entity: %lu\r\n\r\n", size, entity));
+  memset(page, 'x', sizeof(page));
+  for (; size > 0; size -= n) {
+    n = size < (long) sizeof(page) ? (unsigned long) size : sizeof(page);
+    write_all(page, n);
+  }
+}
+
+static int listen_unix(path)
+     char* path;
+{
+  struct sockaddr_un sa;
+  int fd;
+
+  if (strlen(path) >= sizeof(sa.sun_path))
+    die("socket path too long");
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, path);
+  unlink(path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0
+      || listen(fd, 128) < 0) {
+    perror(path);
+    exit(1);
+  }
+  return fd;
+}
+
+static int listen_tcp(port)
+     int port;
+{
+  struct sockaddr_in sa;
+  int fd;
+  int on = 1;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons(port);
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd >= 0)
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char*) &on, sizeof(on));
+  if (fd < 0 || bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0
+      || listen(fd, 128) < 0) {
+    perror("link_bench_server: TCP port");
+    exit(1);
+  }
+  return fd;
+}
+
+int main(argc, argv)
+     int argc;
+     char** argv;
+{
+  struct pollfd pfd[2];
+  int npfd = 0;
+  int unix_fd = -1;
+  int tcp_fd = -1;
+  int c, i;
+
+  while ((c = getopt(argc, argv, "u:p:s:l:")) != -1) {
+    switch (c) {
+    case 'u':
+      if (unix_fd >= 0)
+        die("only one -u may be given");
+      unix_fd = listen_unix(optarg);
+      pfd[npfd++].fd = unix_fd;
+      break;
+    case 'p':
+      if (tcp_fd >= 0)
+        die("only one -p may be given");
+      tcp_fd = listen_tcp(atoi(optarg));
+      pfd[npfd++].fd = tcp_fd;
+      break;
+    case 's':
+      page_size = atol(optarg);
+      break;
+    case 'l':
+      latency_ms = atol(optarg);
+      break;
+    default:
+      npfd = 0;
+      optind = argc + 1;
+    }
+  }
+  if (npfd == 0 || optind != argc) {
+    fprintf(stderr, "usage: link_bench_server [-u socket] [-p port]"
+            " [-s bytes] [-l ms]\n");
+    return 2;
+  }
+
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  for (i = 0; i < npfd; i++)
+    pfd[i].events = POLLIN;
+
+  for (;;) {
+    if (poll(pfd, npfd, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      die("poll failed");
+    }
+    for (i = 0; i < npfd; i++) {
+      if (!(pfd[i].revents & POLLIN))
+        continue;
+      conn = accept(pfd[i].fd, 0, 0);
+      if (conn < 0)
+        continue;
+      if (fork() == 0) {
+        for (i = 0; i < npfd; i++)
+          close(pfd[i].fd);
+        serve();
+        _exit(0);
+      }
+      close(conn);
+    }
+  }
+}
@@ -1,5 +1,8 @@
 #!/usr/bin/perl
 
 do 'syscfg';
-system "$CC $CFLAGS $DEFS $LIBS tlink.c -o ../bin/tlink";
-system "$CC $CFLAGS $DEFS $LIBS vlink.c -o ../bin/vlink";
+system "$CC $CFLAGS $DEFS $LIBS tlink.c link.c linkfcgi.c linkconn.c linkcache.c linkstats.c linktable.c -o ../bin/tlink";
+system "$CC $CFLAGS $DEFS $LIBS vlink.c link.c linkfcgi.c linkconn.c linkcache.c linkstats.c linktable.c -o ../bin/vlink";
+system "$CC $CFLAGS $DEFS $LIBS linkstat.c linkstats.c linktable.c -o ../bin/linkstat";
+system "$CC $CFLAGS $DEFS $LIBS bench/link_bench_server.c -o bench/link_bench_server";
+system "$CC $CFLAGS $DEFS $LIBS bench/link_bench.c -o bench/link_bench";
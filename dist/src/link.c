@@ -0,0 +1,1128 @@
+/*
+ * link.c: passes a request to the Interchange server and relays the
+ *         response; shared by the vlink and tlink link programs
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ * Copyright (C) 1996-2002 Red Hat, Inc.
+ * Copyright (C) 1995 by Andrew M. Wilcox <amw@wilcoxsolutions.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE		/* for splice() */
+#endif
+
+#include "config.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "link.h"
+#include "linkconn.h"
+#include "linkcache.h"
+#include "linkstats.h"
+
+int sock = -1;			/* socket fd */
+int link_fcgi = 0;		/* nonzero while running as a FastCGI responder */
+int link_client_out = CGIOUT;	/* where the response goes */
+
+static char** process_environ;	/* our own environment under FastCGI */
+
+/* The page cache, if there is one, and this request's key to it.
+ */
+static link_cache* cache;
+static char* cache_key;
+static int cache_filling;	/* this request is to store the page */
+static char* cache_copy;	/* the copy of it made so far */
+
+/* The server's statistics, and the timing of this request to it.
+ */
+static link_stats* stats;
+static int timing;		/* the request has been counted as begun */
+static long long request_start;	/* when it began, in microseconds */
+static long long phase_start;	/* when the current phase began */
+static long long phase_us[LINK_PHASES];
+
+static void end_phase(phase)
+     int phase;
+{
+  long long now = link_now_us();
+
+  phase_us[phase] = now - phase_start;
+  phase_start = now;
+}
+
+/* The request is over, with the response STATUS, or 0 for none.
+ */
+static void end_timing(status)
+     int status;
+{
+  if (!timing)
+    return;
+  timing = 0;
+  phase_us[LINK_PHASE_TOTAL] = link_now_us() - request_start;
+  link_stats_end(stats, status, phase_us);
+}
+
+/* Give up on the current request, wherever it got to, so that it isn't
+ * left counted as in flight.  A request that was to get its page for
+ * the cache gives up on that, so that others needn't wait for it.
+ * Nothing is left to do for a request that has finished.
+ */
+void link_abandon()
+{
+  end_timing(0);
+  if (cache_filling) {
+    cache_filling = 0;
+    link_cache_abandon(cache, cache_key, strlen(cache_key));
+  }
+  free(cache_copy);
+  cache_copy = 0;
+}
+
+/* Leave the current request.  A CGI program simply exits; a FastCGI
+ * responder goes back for the next request instead.
+ */
+void link_exit(status)
+     int status;
+{
+  link_abandon();
+  if (link_fcgi)
+    fcgi_bailout(status);
+  exit(status);
+}
+
+/* Look up an environment variable.  Under FastCGI the environment is
+ * that of the request, so fall back to the one we were started with
+ * for settings such as MINIVEND_SOCKET given to the process manager.
+ */
+char* link_getenv(name)
+     const char* name;
+{
+  char* value;
+  char** e;
+  int len;
+
+  value = getenv(name);
+  if (value != 0 || process_environ == 0)
+    return value;
+
+  len = strlen(name);
+  for (e = process_environ;  *e != 0;  ++e) {
+    if (strncmp(*e, name, len) == 0 && (*e)[len] == '=')
+      return *e + len + 1;
+  }
+  return 0;
+}
+
+/* Read up to LEN bytes of the request entity from the client.
+ */
+int client_read(buf, len)
+     char* buf;
+     int len;
+{
+  int n;
+
+  if (link_fcgi)
+    return fcgi_read(buf, len);
+  do {
+    n = read(0, buf, len);
+  } while (n < 0 && errno == EINTR);
+  return n;
+}
+
+/* Write up to LEN bytes of the response to the client, returning
+ * the number written.
+ */
+int client_write(buf, len)
+     const char* buf;
+     int len;
+{
+  if (link_fcgi)
+    return fcgi_write(buf, len);
+  return write(CGIOUT, buf, len);
+}
+
+/* Write the null-terminated STR to the client.
+ */
+void client_puts(str)
+     const char* str;
+{
+  if (link_fcgi)
+    fcgi_write(str, strlen(str));
+  else
+    fputs(str, stdout);
+}
+
+/* Return this message to the browser when the server is not running.
+ */
+void server_not_running()
+{
+  client_puts(LINK_MESSAGE_HEAD);
+  client_puts(LINK_MESSAGE_LINE1);
+  client_puts(LINK_MESSAGE_LINE2);
+  client_puts(LINK_MESSAGE_LINE3);
+  client_puts(LINK_MESSAGE_LINE4);
+  link_exit(1);
+}
+
+/* Connect sock to the server at SA, which the circuit breaker knows
+ * as NAME.  A failed connect is retried with a growing delay for up
+ * to LINK_TIMEOUT seconds, long enough for the server to restart; but
+ * while the breaker says the server is down the client gets the "not
+ * running" page at once.  Each refusal counts against the breaker as
+ * it happens, so that it opens within seconds of the server going
+ * away, while requests already retrying go on until the first of them
+ * connects and closes it.  The request that makes the breaker's trial
+ * gives up at the first refusal, as the others are waiting on it.
+ */
+void connect_server(family, sa, size, name)
+     int family;
+     struct sockaddr* sa;
+     int size;
+     char* name;
+{
+  static link_breaker* breaker = 0;
+  static char* breaker_name = 0;
+  static char* breaker_file = 0;
+  static char* stats_name = 0;
+  static char* stats_file = 0;
+  long long deadline;
+  char* file;
+  int allowed;
+  int attempt;
+  int delay;
+  int e;
+
+  file = link_getenv("MINIVEND_BREAKER");
+  if (file == 0)
+    file = LINK_BREAKER;
+  if (breaker_name == 0 || strcmp(breaker_name, name) != 0
+      || strcmp(breaker_file, file) != 0) {
+    free(breaker);
+    free(breaker_name);
+    free(breaker_file);
+    breaker_name = strdup(name);
+    breaker_file = strdup(file);
+    breaker = link_breaker_open(file, name, LINK_BREAKER_FAILURES,
+				LINK_BREAKER_COOLDOWN);
+  }
+
+  file = link_getenv("MINIVEND_STATS");
+  if (file == 0)
+    file = LINK_STATS;
+  if (stats_name == 0 || strcmp(stats_name, name) != 0
+      || strcmp(stats_file, file) != 0) {
+    free(stats);
+    free(stats_name);
+    free(stats_file);
+    stats_name = strdup(name);
+    stats_file = strdup(file);
+    stats = link_stats_open(file, name);
+  }
+
+  allowed = link_breaker_allow(breaker);
+  if (!allowed) {
+    link_stats_turned_away(stats);
+    server_not_running();
+  }
+
+  deadline = link_now_ms() + LINK_TIMEOUT * 1000LL;
+  for (attempt = 0; ; attempt++) {
+    sock = socket(family, SOCK_STREAM, 0);
+    e = errno;
+    if (sock < 0)
+      die(e, "Could not open socket");
+
+    if (link_connect(sock, sa, size, LINK_CONNECT_TIMEOUT) == 0) {
+      link_breaker_success(breaker);
+      end_phase(LINK_PHASE_CONNECT);
+      if (!timing) {
+	link_stats_begin(stats);
+	timing = 1;
+      }
+      return;
+    }
+    e = errno;
+    close(sock);
+    sock = -1;
+    link_stats_connect_failed(stats);
+
+    /* A server that was only too busy to accept isn't down.
+     */
+    if (!link_connect_busy(e)) {
+      link_breaker_failure(breaker);
+      if (allowed == LINK_BREAKER_TRIAL)
+	break;
+    }
+
+    delay = link_backoff_ms(attempt, LINK_RETRY_DELAY);
+    if (link_now_ms() + delay >= deadline)
+      break;
+    link_pause_ms(delay);
+  }
+  link_stats_turned_away(stats);
+  server_not_running();
+}
+
+/* Return this message to the browser when a system error occurs.
+ */
+void die(e, msg)
+     int e;
+     char* msg;
+{
+  char line[256];
+
+  client_puts("Status: 503 Service Unavailable\r\n");
+  client_puts("Content-type: text/plain\r\n\r\n");
+  client_puts("We are sorry, but the Interchange server is unavailable due to a\r\n");
+  client_puts("system error.\r\n\r\n");
+  if (e) {
+    snprintf(line, sizeof(line), "%s: %s (%d)\r\n", msg, ERRMSG(e), e);
+  }
+  else {
+    snprintf(line, sizeof(line), "%s\r\n", msg);
+  }
+  client_puts(line);
+  link_exit(1);
+}
+
+
+/* Length of the entity on stdin, if present.  The entity itself is
+ * passed on to the server as it is read, and never held in memory
+ * all at once.
+ */
+static long entity_len = 0;
+static long entity_sent = 0;	/* how much of it has been read */
+
+static void
+get_entity()
+{
+  char* cl;
+
+  entity_len = 0;
+  entity_sent = 0;
+  cl = getenv("CONTENT_LENGTH");
+  if (cl != 0)
+    entity_len = strtol(cl, 0, 10);
+  if (entity_len < 0)
+    entity_len = 0;
+}
+
+
+static jmp_buf reopen_socket;	/* bailout when server shuts down */
+#define buf_size 1024		/* output buffer size */
+static char buf[buf_size];	/* output buffer */
+static char* bufp;		/* current position in output buffer */
+static int buf_left;		/* space left in output buffer */
+
+/* Close the socket connection.
+ */
+static void close_socket()
+{
+  int s = sock;
+
+  sock = -1;
+  if (close(s) < 0)
+    die(errno, "close");
+}
+
+/* Write LEN characters from P to the socket.  If the cgi-bin server
+ * has 'listen'ed on the socket but closes it before 'accept'ing our
+ * connection, we'll get a EPIPE here and retry the connection over
+ * again -- unless we have started on the entity, which can't be read
+ * a second time.
+ */
+static void write_sock(p, len)
+     char* p;
+     int len;
+{
+  int w;
+
+  while (len > 0) {
+    do {
+      w = write(sock, p, len);
+    } while (w < 0 && errno == EINTR); /* retry on interrupted system call */
+    if (w < 0 && errno == EPIPE && entity_sent == 0) /* server closed */
+      longjmp(reopen_socket, 1); /* try to reopen the connection */
+    if (w < 0)
+      die(errno, "write");
+    p += w;			/* write the rest out if short write */
+    len -= w;
+  }
+}
+
+/* Write out the output buffer to the socket.
+ */
+static void write_out()
+{
+  write_sock(buf, bufp - buf);
+  bufp = buf;			/* reset output buffer */
+  buf_left = buf_size;
+}
+
+/* Write out LEN characters from STR to the cgi-bin server.
+ */
+static void out(len, str)
+     int len;
+     char* str;
+{
+  char* strp = str;
+  int str_left = len;
+
+  while (str_left > 0) {
+    if (str_left < buf_left) {	       /* all fits in buffer */
+      memcpy(bufp, strp, str_left);
+      bufp += str_left;
+      buf_left -= str_left;
+      str_left = 0;
+    }
+    else {			       /* only part fits */
+      memcpy(bufp, strp, buf_left);    /* copy in as much as fits */
+      str_left -= buf_left;
+      strp += buf_left;
+      bufp += buf_left;
+      write_out();		       /* write out buffer */
+    }
+  }
+}
+
+/* Writes the null-terminated STR to the cgi-bin server.
+ */
+static void outs(str)
+     char* str;
+{
+  out(strlen(str), str);
+}
+
+/* Returns I as an ascii string.  Don't some systems define itoa for you?
+ */
+static char* itoa(i)
+     int i;
+{
+  static char buf[32];
+  sprintf(buf, "%d", i);
+  return buf;
+}
+
+/* Sends the null-terminated value STR to the cgi-bin server.  First
+ * writes the length, then a space, then the value, and finally an
+ * aesthetic newline.
+ */
+static void outv(str)
+     char* str;
+{
+  int len = strlen(str);
+
+  outs(itoa(len));
+  out(1, " ");
+  out(len, str);
+  out(1, "\n");
+}
+
+/* The binary protocol (LINK_PROTOCOL 2) sends a preamble, then each
+ * block as a frame: a type byte, a 32-bit big-endian length and that
+ * much payload.  Strings in the payload are length-prefixed the same
+ * way, so the server can unpack a whole block at once.
+ */
+#define FRAME_PREAMBLE "\0ICL\2"
+#define FRAME_ARGS 'A'
+#define FRAME_ENV 'E'
+#define FRAME_ENTITY 'B'
+#define FRAME_END 'Z'
+
+static int protocol;		/* link protocol in use for this request */
+
+/* Writes N to the cgi-bin server as four bytes, most significant first.
+ */
+static void out_u32(n)
+     unsigned long n;
+{
+  char b[4];
+
+  b[0] = (n >> 24) & 0xff;
+  b[1] = (n >> 16) & 0xff;
+  b[2] = (n >> 8) & 0xff;
+  b[3] = n & 0xff;
+  out(4, b);
+}
+
+/* Starts a frame of TYPE with LEN bytes of payload.
+ */
+static void out_frame(type, len)
+     int type;
+     unsigned long len;
+{
+  char t = type;
+
+  out(1, &t);
+  out_u32(len);
+}
+
+/* Send the program arguments (but not the program name argv[0])
+ * to the server.
+ */
+static void send_arguments(argc, argv)
+     int argc;
+     char** argv;
+{
+  unsigned long len;
+  int i;
+
+  if (protocol == 2) {
+    for (i = 1, len = 0;  i < argc;  ++i)
+      len += 4 + strlen(argv[i]);
+    out_frame(FRAME_ARGS, len);
+    for (i = 1;  i < argc;  ++i) {
+      out_u32(strlen(argv[i]));
+      outs(argv[i]);
+    }
+    return;
+  }
+
+  outs("arg ");
+  outs(itoa(argc - 1));		       /* number of arguments */
+  outs("\n");
+  for (i = 1;  i < argc;  ++i) {
+    outv(argv[i]);
+  }
+}
+
+/* Send the environment to the server.
+ */
+static void send_environment()
+{
+  unsigned long len;
+  char* value;
+  int n;
+  char** e;
+
+  if (protocol == 2) {
+    for (e = environ, len = 0;  *e != 0;  ++e) {
+      if (strchr(*e, '=') != 0)
+        len += 8 + strlen(*e) - 1;
+    }
+    out_frame(FRAME_ENV, len);
+    for (e = environ;  *e != 0;  ++e) {
+      if ((value = strchr(*e, '=')) == 0)
+        continue;
+      out_u32(value - *e);
+      out(value - *e, *e);
+      ++value;
+      out_u32(strlen(value));
+      outs(value);
+    }
+    return;
+  }
+
+  /* count number of env variables */
+  for (e = environ, n = 0;  *e != 0;  ++e, ++n)
+    ;
+
+  outs("env ");
+  outs(itoa(n));		       /* number of vars */
+  outs("\n");
+  for (e = environ;  *e != 0;  ++e) {
+    outv(*e);
+  }
+}
+
+/* The client sent less entity than it said it would.  The server has
+ * been promised the full length, so hang up on it before telling the
+ * client.
+ */
+static void short_entity()
+{
+  close(sock);
+  sock = -1;
+  client_puts("Status: 400 Bad Request\r\n");
+  client_puts("Content-type: text/plain\r\n\r\n");
+  client_puts("The request body was shorter than its Content-Length.\r\n");
+  link_exit(1);
+}
+
+#define ENTITY_CHUNK 16384	/* entity copy buffer size */
+#define ENTITY_SPLICE 65536	/* most entity to splice() at once */
+
+static char entity_chunk[ENTITY_CHUNK];
+
+/* Copy the entity from the client to the server through a buffer.
+ */
+static void copy_entity()
+{
+  long want;
+  int n;
+
+  while (entity_sent < entity_len) {
+    want = entity_len - entity_sent;
+    if (want > ENTITY_CHUNK)
+      want = ENTITY_CHUNK;
+    n = client_read(entity_chunk, want);
+    if (n < 0)
+      die(errno, "read");
+    if (n == 0)
+      short_entity();
+    entity_sent += n;
+    write_sock(entity_chunk, n);
+  }
+}
+
+#ifdef SPLICE_F_MOVE
+/* Move the entity from stdin to the server without copying it through
+ * user space.  splice() needs a pipe at one end, so unless stdin is a
+ * pipe already the entity goes by way of one of our own.  Returns 0 if
+ * splice() can't be used, leaving the job to copy_entity().
+ */
+static int splice_entity()
+{
+  struct stat st;
+  int fds[2];
+  int direct;
+  long want;
+  ssize_t n;
+  ssize_t m;
+
+  if (link_fcgi || fstat(0, &st) < 0)
+    return 0;
+  direct = S_ISFIFO(st.st_mode);
+  if (!direct && pipe(fds) < 0)
+    return 0;
+
+  while (entity_sent < entity_len) {
+    want = entity_len - entity_sent;
+    if (want > ENTITY_SPLICE)
+      want = ENTITY_SPLICE;
+    do {
+      n = splice(0, 0, direct ? sock : fds[1], 0, want,
+                 SPLICE_F_MOVE | SPLICE_F_MORE);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && entity_sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+      if (!direct) {
+        close(fds[0]);
+        close(fds[1]);
+      }
+      return 0;
+    }
+    if (n < 0)
+      die(errno, "splice");
+    if (n == 0)
+      short_entity();
+    entity_sent += n;
+
+    while (!direct && n > 0) {
+      do {
+        m = splice(fds[0], 0, sock, 0, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+      } while (m < 0 && errno == EINTR);
+      if (m < 0)
+        die(errno, "splice");
+      n -= m;
+    }
+  }
+
+  if (!direct) {
+    close(fds[0]);
+    close(fds[1]);
+  }
+  return 1;
+}
+#endif
+
+/* Send entity if we have one.  What we have so far goes out first, so
+ * the server can get on with it while the entity is still arriving.
+ */
+static void
+send_entity()
+{
+  char len[32];
+
+  if (entity_len > 0) {
+    if (protocol == 2) {
+      if ((unsigned long) entity_len > 0xffffffffUL)
+        die(0, "Request body too large");
+      out_frame(FRAME_ENTITY, entity_len);
+    }
+    else {
+      sprintf(len, "%ld", entity_len);
+      outs("entity\n");
+      outs(len);
+      out(1, " ");
+    }
+    write_out();
+#ifdef SPLICE_F_MOVE
+    if (!splice_entity())
+#endif
+      copy_entity();
+    if (protocol != 2)
+      out(1, "\n");
+  }
+}
+
+/* Mark the end of the request.
+ */
+static void send_end()
+{
+  if (protocol == 2)
+    out_frame(FRAME_END, 0);
+  else
+    outs("end\n");
+}
+
+#define RELAY_SIZE 65536		/* response ring buffer size */
+#define RELAY_PIPE_SIZE 1048576	/* stdout pipe size to ask for */
+
+/* The response on its way from the server to the client.  Reading from
+ * the server stops while the ring is full, so a slow client holds back
+ * the server instead of the response piling up in our memory.
+ */
+static char relay[RELAY_SIZE];
+static int relay_start;		/* first byte not yet written */
+static int relay_len;		/* bytes waiting to be written */
+
+static int read_from_server()
+{
+  int end = (relay_start + relay_len) % RELAY_SIZE;
+  int room = (end < relay_start ? relay_start : RELAY_SIZE) - end;
+  int n;
+
+  do {
+    n = read(sock, relay + end, room);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0 && errno == EAGAIN)
+    return 1;
+  if (n < 0)
+    die(errno, "read");
+  if (n == 0)
+    return 0;
+  relay_len += n;
+  return 1;
+}
+
+static void write_to_client()
+{
+  int b = RELAY_SIZE - relay_start;
+  int n;
+
+  if (b > relay_len)
+    b = relay_len;
+  do {
+    n = client_write(relay + relay_start, b);
+  } while (n < 0 && errno == EINTR);
+  if (n < 0 && errno == EAGAIN)
+    return;
+  if (n < 0)
+    die(errno, "write");
+  relay_start = (relay_start + n) % RELAY_SIZE;
+  relay_len -= n;
+  if (relay_len == 0)
+    relay_start = 0;
+}
+
+#ifdef SPLICE_F_MOVE
+/* When stdout is a pipe, move the response into it straight from the
+ * socket.  A bigger pipe lets the kernel take all of a typical page at
+ * once, letting the server get on with its next request sooner; if the
+ * client is slow, splice() simply waits for room.  Returns 0 if
+ * splice() can't be used, leaving the job to return_response().
+ */
+static int splice_response()
+{
+  struct stat st;
+  ssize_t n;
+  int moved = 0;
+
+  if (link_fcgi || fstat(CGIOUT, &st) < 0 || !S_ISFIFO(st.st_mode))
+    return 0;
+
+#ifdef F_SETPIPE_SZ
+  fcntl(CGIOUT, F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+#endif
+
+  for (;;) {
+    do {
+      n = splice(sock, 0, CGIOUT, 0, RELAY_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && !moved && (errno == EINVAL || errno == ENOSYS))
+      return 0;
+    if (n < 0)
+      die(errno, "splice");
+    if (n == 0)
+      return 1;
+    moved = 1;
+  }
+}
+#endif
+
+static void return_response()
+{
+  struct pollfd fds[2];
+  int reading;
+  int nfds;
+  int r;
+  int i;
+
+#ifdef SPLICE_F_MOVE
+  if (splice_response())
+    return;
+#endif
+
+  /* A FastCGI connection stays blocking; records are written whole. */
+  if (!link_fcgi && fcntl(CGIOUT, F_SETFL, O_NONBLOCK) < 0)
+    die(errno, "fcntl");
+
+  reading = 1;
+  relay_start = relay_len = 0;
+
+  for (;;) {
+    nfds = 0;
+    if (reading && relay_len < RELAY_SIZE) {
+      fds[nfds].fd = sock;
+      fds[nfds].events = POLLIN;
+      ++nfds;
+    }
+    if (relay_len > 0) {
+      fds[nfds].fd = link_client_out;
+      fds[nfds].events = POLLOUT;
+      ++nfds;
+    }
+
+    if (nfds == 0)
+      break;
+
+    do {
+      r = poll(fds, nfds, -1);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0)
+      die(errno, "poll");
+
+    for (i = 0;  i < nfds;  ++i) {
+      if (fds[i].revents == 0)
+        continue;
+      if (fds[i].fd == sock) {
+        if (!read_from_server())
+          reading = 0;
+      }
+      else {
+        write_to_client();
+      }
+    }
+  }
+}
+
+
+static link_cache* open_cache()
+{
+  static char* cache_file = 0;
+  char* file;
+
+  file = link_getenv("MINIVEND_CACHE");
+  if (file == 0)
+    file = LINK_CACHE;
+  if (cache_file == 0 || strcmp(cache_file, file) != 0) {
+    free(cache);
+    free(cache_file);
+    cache_file = strdup(file);
+    cache = *file ? link_cache_open(file, LINK_CACHE_SIZE) : 0;
+  }
+  return cache;
+}
+
+/* Only plain GETs by visitors without a session may be answered from
+ * the cache, as any other page may be theirs alone.
+ */
+static int cacheable()
+{
+  char* method = getenv("REQUEST_METHOD");
+
+  return method != 0 && strcmp(method, "GET") == 0 && entity_len == 0
+    && getenv("REQUEST_URI") != 0 && getenv("HTTP_AUTHORIZATION") == 0
+    && !link_cache_cookie(getenv("HTTP_COOKIE"), LINK_CACHE_COOKIE);
+}
+
+/* The request variable named by the N bytes at NAME.
+ */
+static char* cache_var(name, n)
+     const char* name;
+     size_t n;
+{
+  char buf[128];
+
+  if (n >= sizeof(buf))
+    return 0;
+  memcpy(buf, name, n);
+  buf[n] = '\0';
+  return getenv(buf);
+}
+
+/* The server name and port, the URI with its query string, then each
+ * variable the pages vary by, one to a line, as mod_interchange has it.
+ */
+static char* make_cache_key()
+{
+  const char* vars;
+  const char* v;
+  char* server = getenv("SERVER_NAME");
+  char* port = getenv("SERVER_PORT");
+  char* uri = getenv("REQUEST_URI");
+  char* value;
+  char* key;
+  size_t len;
+  size_t n;
+
+  vars = link_getenv("MINIVEND_CACHE_KEY");
+  if (vars == 0)
+    vars = LINK_CACHE_KEY;
+  if (server == 0)
+    server = "";
+  if (port == 0)
+    port = "";
+
+  len = strlen(server) + strlen(port) + strlen(uri) + 3;
+  for (v = vars; *v; v += n) {
+    while (*v == ' ')
+      v++;
+    for (n = 0; v[n] && v[n] != ' '; n++)
+      ;
+    value = cache_var(v, n);
+    len += n + 2 + (value != 0 ? strlen(value) : 0);
+  }
+
+  key = (char*) malloc(len + 1);
+  if (key == 0)
+    return 0;
+  sprintf(key, "%s:%s\n%s\n", server, port, uri);
+  for (v = vars; *v; v += n) {
+    while (*v == ' ')
+      v++;
+    for (n = 0; v[n] && v[n] != ' '; n++)
+      ;
+    if (n == 0)
+      break;
+    value = cache_var(v, n);
+    strncat(key, v, n);
+    strcat(key, "=");
+    if (value != 0)
+      strcat(key, value);
+    strcat(key, "\n");
+  }
+  return key;
+}
+
+static void write_all(data, len)
+     const char* data;
+     size_t len;
+{
+  int n;
+
+  while (len > 0) {
+    do {
+      n = client_write(data, len);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+      die(errno, "write");
+    data += n;
+    len -= n;
+  }
+}
+
+/* Answer the request from the cache if the page is there, returning 1,
+ * or find out whether this request is to get it for the cache.
+ */
+static int check_cache()
+{
+  char* data;
+  size_t len;
+
+  cache_filling = 0;
+  free(cache_key);
+  cache_key = 0;
+  if (!cacheable() || open_cache() == 0
+      || (cache_key = make_cache_key()) == 0)
+    return 0;
+
+  switch (link_cache_get(cache, cache_key, strlen(cache_key), &data, &len,
+			 LINK_CACHE_WAIT)) {
+  case LINK_CACHE_HIT:
+    cache_copy = data;		/* for link_abandon() to free */
+    write_all(data, len);
+    free(cache_copy);
+    cache_copy = 0;
+    return 1;
+  case LINK_CACHE_FILL:
+    cache_filling = 1;
+    break;
+  }
+  return 0;
+}
+
+/* Relay the response, keeping a copy of it as it goes, and store the
+ * copy in the cache if the response says it may be kept.  A response
+ * that grows too big for the cache stops being copied, so others can
+ * stop waiting for it, and the rest of it is relayed as usual.
+ */
+static void fill_cache()
+{
+  size_t size = 16384;
+  size_t got = 0;
+  long fresh;
+  long stale;
+  char* more;
+  int n;
+
+  /* The copy is kept where link_abandon() can free it if the request
+   * is given up on part way.
+   */
+  cache_copy = (char*) malloc(size);
+  while (cache_copy != 0) {
+    if (got == size) {
+      more = 0;
+      if (got <= LINK_CACHE_MAX_PAGE) {
+	size = got > LINK_CACHE_MAX_PAGE / 2 ? LINK_CACHE_MAX_PAGE + 1
+					       : size * 2;
+	more = (char*) realloc(cache_copy, size);
+      }
+      if (more == 0) {
+	free(cache_copy);
+	cache_copy = 0;
+	break;
+      }
+      cache_copy = more;
+    }
+    do {
+      n = read(sock, cache_copy + got, size - got);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+      die(errno, "read");
+    if (n == 0)
+      break;
+    write_all(cache_copy + got, n);
+    got += n;
+  }
+  cache_filling = 0;
+
+  if (cache_copy != 0
+      && (fresh = link_cache_lifetime(cache_copy, got, &stale)) > 0)
+    link_cache_put(cache, cache_key, strlen(cache_key), cache_copy, got,
+		   fresh, stale >= 0 ? stale : LINK_CACHE_STALE * 1000L);
+  else
+    link_cache_abandon(cache, cache_key, strlen(cache_key));
+
+  if (cache_copy != 0) {
+    free(cache_copy);
+    cache_copy = 0;
+  } else
+    return_response();
+}
+
+/* Wait for the server to start its response, returning its status.
+ * The response is only looked at, and left to be read as usual.
+ */
+static int await_response()
+{
+  char head[512];
+  int n;
+
+  do {
+    n = recv(sock, head, sizeof(head), MSG_PEEK);
+  } while (n < 0 && errno == EINTR);
+  end_phase(LINK_PHASE_WAIT);
+  return n > 0 ? link_stats_status(head, n) : 0;
+}
+
+/* Pass one request on to the server and relay its response.
+ */
+void link_request(argc, argv)
+     int argc;
+     char** argv;
+{
+  char* p;
+  int status;
+  int i;
+
+  get_entity();
+
+  /* Only servers that know the binary protocol can be sent it. */
+  p = link_getenv("MINIVEND_PROTOCOL");
+  protocol = p != 0 ? atoi(p) : LINK_PROTOCOL;
+
+  if (check_cache())
+    return;
+
+  timing = 0;
+  request_start = phase_start = link_now_us();
+  for (i = 0;  i < LINK_PHASES;  ++i)
+    phase_us[i] = -1;
+
+  /* If the server does close the socket, jump back here to reopen. */
+  if (setjmp(reopen_socket)) {
+    close_socket();		       /* close our end of old socket */
+  }
+
+  bufp = buf;			       /* init output buf */
+  buf_left = buf_size;
+  open_socket();		       /* open our connection */
+  if (protocol == 2)
+    out(sizeof(FRAME_PREAMBLE) - 1, FRAME_PREAMBLE);
+  send_arguments(argc, argv);
+  send_environment();
+  send_entity();
+  send_end();
+  write_out();			       /* flush output buffer */
+  end_phase(LINK_PHASE_SEND);
+  status = stats != 0 ? await_response() : 200;
+
+  if (cache_filling)
+    fill_cache();
+  else
+    return_response();
+  end_phase(LINK_PHASE_DRAIN);
+  end_timing(status);
+  close_socket();
+}
+
+int link_main(argc, argv)
+     int argc;
+     char** argv;
+{
+
+  /* Give us an EPIPE error instead of a SIGPIPE signal if the server
+   * closes the socket on us.
+   */
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    die(errno, "signal");
+
+  /* Started by a FastCGI process manager: stay resident and answer
+   * requests until told to go away.
+   */
+  if (fcgi_is_listener()) {
+    process_environ = environ;
+    return fcgi_run(argv);
+  }
+
+  link_request(argc, argv);
+  return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ * link.h: declarations shared by the vlink and tlink link programs
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+#ifndef LINK_H
+#define LINK_H
+
+struct sockaddr;
+
+#ifndef ENVIRON_DECLARED
+extern char** environ;
+#endif
+
+/* CGI output to the server is on stdout, fd 1.
+ */
+#define CGIOUT 1
+
+#ifdef HAVE_STRERROR
+#define ERRMSG strerror
+#else
+#define ERRMSG perror
+#endif
+
+/* link.c: the request relay common to both link programs.
+ */
+extern int sock;			/* socket fd to Interchange */
+extern int link_fcgi;			/* answering FastCGI requests */
+extern int link_client_out;		/* fd the response is written to */
+
+void server_not_running(void);
+void die(int e, char* msg);
+void link_abandon(void);
+void link_exit(int status);
+char* link_getenv(const char* name);
+int client_read(char* buf, int len);
+int client_write(const char* buf, int len);
+void client_puts(const char* str);
+void connect_server(int family, struct sockaddr* sa, int size, char* name);
+void link_request(int argc, char** argv);
+int link_main(int argc, char** argv);
+
+/* vlink.c / tlink.c: make a connection to the server, setting sock.
+ */
+void open_socket(void);
+
+/* linkfcgi.c: FastCGI responder.
+ */
+int fcgi_is_listener(void);
+int fcgi_run(char** argv);
+int fcgi_read(char* buf, int len);
+int fcgi_write(const char* buf, int len);
+void fcgi_bailout(int status);
+
+#endif /* LINK_H */
@@ -0,0 +1,787 @@
+/*
+ * linkcache.c: page cache shared by the link programs and mod_interchange
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+/* Pages that Interchange says may be cached, by Cache-Control,
+ * X-Accel-Expires or Expires, are kept exactly as the server sent them,
+ * headers and all, so that a later request for the same page can be
+ * answered without troubling the server.
+ *
+ * The cache is a file mapped by every process using it.  It holds a
+ * table of entries, found by a hash of the key, and the pages
+ * themselves in a pool of fixed-size blocks; when the pool runs out,
+ * the least recently used pages are thrown away.  The whole cache is
+ * guarded by one lock, which is only held while entries are looked up
+ * and pages copied in or out.
+ *
+ * When a page is wanted that isn't in the cache, the first request
+ * gets it from the server and the others wait for it to be stored
+ * rather than all asking the server for it at once.  Once a page is
+ * past its lifetime it can still be used for a while: one request
+ * gets a fresh copy while the others are given the old one.  A page
+ * that turns out not to be cacheable is remembered for a few seconds,
+ * so that requests for it don't wait on each other in the meantime.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "linkcache.h"
+#include "linkconn.h"
+
+#define CACHE_MAGIC	0x49434331	/* "ICC1" */
+#define CACHE_BLOCK	4096		/* bytes in a block */
+#define CACHE_MIN	16		/* fewest blocks worth having */
+#define CACHE_NIL	(-1)
+
+#define ENTRY_FREE	0
+#define ENTRY_PENDING	1		/* being got from the server */
+#define ENTRY_VALID	2
+#define ENTRY_PASS	3		/* found not to be cacheable */
+
+#define CACHE_PASS_MS	10000		/* how long to remember that */
+
+struct cache_head {
+  unsigned int magic;
+  volatile int lock;			/* pid holding the lock, or 0 */
+  volatile int dirty;			/* tables being changed */
+  int count;				/* entries, buckets and blocks */
+  long long size;			/* of the file */
+  int lru_first, lru_last;		/* most and least recently used */
+  int free_entry, free_block;
+  int free_blocks;
+  int unused;
+  unsigned long hits, stale_hits, fills, passes, stores, evictions;
+};
+
+struct cache_entry {
+  unsigned int hash;
+  int state;
+  int chain;				/* next in the bucket, or free */
+  int newer, older;			/* neighbours in the LRU list */
+  int block;				/* first block of the key and page */
+  unsigned int keylen;
+  unsigned int len;			/* of the page */
+  long long fresh_until;		/* ms, by the time of day */
+  long long stale_until;
+  long long filling;			/* when a request set out to get it */
+};
+
+struct link_cache {
+  struct cache_head* head;
+  struct cache_entry* entry;
+  int* bucket;
+  int* block_next;
+  char* block;
+};
+
+/* Expiry is by the time of day, since the file outlives a reboot.
+ */
+static long long wall_ms(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, 0);
+  return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static unsigned int hash_key(const char* key, size_t keylen)
+{
+  unsigned int h = 2166136261U;
+
+  while (keylen-- > 0)
+    h = (h ^ (unsigned char) *key++) * 16777619U;
+  return h;
+}
+
+static size_t align8(size_t n)
+{
+  return (n + 7) & ~(size_t) 7;
+}
+
+/* Point the tables of C into the mapping at BASE.
+ */
+static void cache_layout(link_cache* c, char* base, int count)
+{
+  size_t off = align8(sizeof(struct cache_head));
+
+  c->head = (struct cache_head*) base;
+  c->entry = (struct cache_entry*) (base + off);
+  off += align8(count * sizeof(struct cache_entry));
+  c->bucket = (int*) (base + off);
+  off += align8(count * sizeof(int));
+  c->block_next = (int*) (base + off);
+  off += align8(count * sizeof(int));
+  c->block = base + off;
+}
+
+static long long cache_size(int count)
+{
+  return align8(sizeof(struct cache_head))
+    + align8(count * sizeof(struct cache_entry))
+    + 2 * align8(count * sizeof(int))
+    + (long long) count * CACHE_BLOCK;
+}
+
+/* Empty the cache, putting every entry and block on its free list.
+ */
+static void cache_clear(link_cache* c)
+{
+  struct cache_head* h = c->head;
+  int i;
+
+  for (i = 0; i < h->count; i++) {
+    c->entry[i].state = ENTRY_FREE;
+    c->entry[i].chain = i + 1 < h->count ? i + 1 : CACHE_NIL;
+    c->bucket[i] = CACHE_NIL;
+    c->block_next[i] = i + 1 < h->count ? i + 1 : CACHE_NIL;
+  }
+  h->lru_first = h->lru_last = CACHE_NIL;
+  h->free_entry = 0;
+  h->free_block = 0;
+  h->free_blocks = h->count;
+}
+
+/* Map FILE as a cache of about SIZE bytes, setting it up if it is new.
+ * An existing cache keeps the size it was made with.  Returns 0 if
+ * the cache can't be used.
+ */
+link_cache* link_cache_open(const char* file, long size)
+{
+  link_cache* c;
+  struct stat st;
+  char* base;
+  int count;
+  int fd;
+
+  if (file == 0 || *file == '\0')
+    return 0;
+  count = 0;
+  while (cache_size(count + 1) <= size)
+    count++;
+  if (count < CACHE_MIN)
+    count = CACHE_MIN;
+
+  fd = open(file, O_RDWR | O_CREAT, 0666);
+  if (fd < 0)
+    return 0;
+  c = (link_cache*) malloc(sizeof(*c));
+  if (c == 0 || flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+    goto fail;
+
+  if (st.st_size == 0) {
+    if (ftruncate(fd, cache_size(count)) < 0)
+      goto fail;
+    st.st_size = cache_size(count);
+  }
+  else if (st.st_size < (off_t) sizeof(struct cache_head))
+    goto fail;
+
+  base = (char*) mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		      fd, 0);
+  if (base == (char*) MAP_FAILED)
+    goto fail;
+
+  if (((struct cache_head*) base)->magic == 0) {
+    cache_layout(c, base, count);
+    c->head->count = count;
+    c->head->size = st.st_size;
+    cache_clear(c);
+    c->head->magic = CACHE_MAGIC;
+  }
+  else {
+    count = ((struct cache_head*) base)->count;
+    if (((struct cache_head*) base)->magic != CACHE_MAGIC
+	|| count < CACHE_MIN || cache_size(count) > st.st_size) {
+      munmap(base, st.st_size);
+      goto fail;
+    }
+    cache_layout(c, base, count);
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+  return c;
+
+fail:
+  close(fd);
+  free(c);
+  return 0;
+}
+
+/* Take the lock.  One left by a process that has died is taken over,
+ * and if that process was in the middle of changing the tables the
+ * cache is emptied, as it can no longer be trusted.
+ */
+static void cache_lock(link_cache* c)
+{
+  struct cache_head* h = c->head;
+  int me = getpid();
+  int owner;
+  int spins;
+
+  for (spins = 1; ; spins++) {
+    owner = h->lock;
+    if (owner == 0 && __sync_bool_compare_and_swap(&h->lock, 0, me))
+      break;
+    if (owner != 0 && spins % 256 == 0 && kill(owner, 0) < 0
+	&& errno == ESRCH && __sync_bool_compare_and_swap(&h->lock, owner, me))
+      break;
+    if (spins < 64)
+      sched_yield();
+    else
+      link_pause_ms(1);
+  }
+  if (h->dirty)
+    cache_clear(c);
+  h->dirty = 1;
+  __sync_synchronize();
+}
+
+static void cache_unlock(link_cache* c)
+{
+  c->head->dirty = 0;
+  __sync_lock_release(&c->head->lock);
+}
+
+/* Read, write or compare N bytes at offset OFF in the chain of blocks
+ * starting at B.  A compare returns nonzero if they differ.
+ */
+#define CHAIN_READ	0
+#define CHAIN_WRITE	1
+#define CHAIN_CMP	2
+
+static int chain_io(link_cache* c, int b, size_t off, char* buf, size_t n,
+		    int how)
+{
+  size_t chunk;
+  char* p;
+
+  while (off >= CACHE_BLOCK) {
+    b = c->block_next[b];
+    off -= CACHE_BLOCK;
+  }
+  while (n > 0) {
+    p = c->block + (size_t) b * CACHE_BLOCK + off;
+    chunk = CACHE_BLOCK - off;
+    if (chunk > n)
+      chunk = n;
+    if (how == CHAIN_READ)
+      memcpy(buf, p, chunk);
+    else if (how == CHAIN_WRITE)
+      memcpy(p, buf, chunk);
+    else if (memcmp(buf, p, chunk) != 0)
+      return 1;
+    buf += chunk;
+    n -= chunk;
+    off = 0;
+    b = c->block_next[b];
+  }
+  return 0;
+}
+
+static int find_entry(link_cache* c, unsigned int hash, const char* key,
+		      size_t keylen)
+{
+  struct cache_entry* e;
+  int i;
+
+  for (i = c->bucket[hash % c->head->count]; i != CACHE_NIL; i = e->chain) {
+    e = &c->entry[i];
+    if (e->hash == hash && e->keylen == keylen
+	&& chain_io(c, e->block, 0, (char*) key, keylen, CHAIN_CMP) == 0)
+      return i;
+  }
+  return CACHE_NIL;
+}
+
+static void lru_unlink(link_cache* c, int i)
+{
+  struct cache_entry* e = &c->entry[i];
+
+  if (e->newer != CACHE_NIL)
+    c->entry[e->newer].older = e->older;
+  else
+    c->head->lru_first = e->older;
+  if (e->older != CACHE_NIL)
+    c->entry[e->older].newer = e->newer;
+  else
+    c->head->lru_last = e->newer;
+}
+
+static void lru_push(link_cache* c, int i)
+{
+  struct cache_entry* e = &c->entry[i];
+
+  e->newer = CACHE_NIL;
+  e->older = c->head->lru_first;
+  if (e->older != CACHE_NIL)
+    c->entry[e->older].newer = i;
+  else
+    c->head->lru_last = i;
+  c->head->lru_first = i;
+}
+
+static void free_chain(link_cache* c, int b)
+{
+  int next;
+
+  while (b != CACHE_NIL) {
+    next = c->block_next[b];
+    c->block_next[b] = c->head->free_block;
+    c->head->free_block = b;
+    c->head->free_blocks++;
+    b = next;
+  }
+}
+
+/* Remove entry I altogether.
+ */
+static void drop_entry(link_cache* c, int i)
+{
+  struct cache_entry* e = &c->entry[i];
+  int* p;
+
+  for (p = &c->bucket[e->hash % c->head->count]; *p != i;
+       p = &c->entry[*p].chain)
+    ;
+  *p = e->chain;
+  lru_unlink(c, i);
+  free_chain(c, e->block);
+  e->state = ENTRY_FREE;
+  e->chain = c->head->free_entry;
+  c->head->free_entry = i;
+}
+
+/* Throw away the least recently used entry other than KEEP.
+ */
+static int evict(link_cache* c, int keep)
+{
+  int i = c->head->lru_last;
+
+  if (i == keep && i != CACHE_NIL)
+    i = c->entry[i].newer;
+  if (i == CACHE_NIL)
+    return 0;
+  drop_entry(c, i);
+  c->head->evictions++;
+  return 1;
+}
+
+/* A chain of blocks to hold N bytes, making room if need be.
+ */
+static int alloc_chain(link_cache* c, size_t n, int keep)
+{
+  int need = (int) ((n + CACHE_BLOCK - 1) / CACHE_BLOCK);
+  int first = CACHE_NIL;
+  int b;
+
+  if (need == 0)
+    need = 1;
+  if (need > c->head->count / 2)
+    return CACHE_NIL;
+  while (c->head->free_blocks < need)
+    if (!evict(c, keep))
+      return CACHE_NIL;
+  while (need-- > 0) {
+    b = c->head->free_block;
+    c->head->free_block = c->block_next[b];
+    c->head->free_blocks--;
+    c->block_next[b] = first;
+    first = b;
+  }
+  return first;
+}
+
+/* A new entry for KEY, with a request about to get the page.
+ */
+static int new_entry(link_cache* c, unsigned int hash, const char* key,
+		     size_t keylen, long long now)
+{
+  struct cache_entry* e;
+  int i;
+
+  if (c->head->free_entry == CACHE_NIL && !evict(c, CACHE_NIL))
+    return CACHE_NIL;
+  i = c->head->free_entry;
+  e = &c->entry[i];
+  c->head->free_entry = e->chain;
+
+  e->block = alloc_chain(c, keylen, i);
+  if (e->block == CACHE_NIL) {
+    e->chain = c->head->free_entry;
+    c->head->free_entry = i;
+    return CACHE_NIL;
+  }
+  chain_io(c, e->block, 0, (char*) key, keylen, CHAIN_WRITE);
+  e->hash = hash;
+  e->keylen = keylen;
+  e->len = 0;
+  e->state = ENTRY_PENDING;
+  e->fresh_until = e->stale_until = 0;
+  e->filling = now;
+  e->chain = c->bucket[hash % c->head->count];
+  c->bucket[hash % c->head->count] = i;
+  lru_push(c, i);
+  return i;
+}
+
+/* Look for the page with KEY.  A copy found in the cache is returned
+ * in DATA, which the caller frees.  If the page has to be got from the
+ * server, only one caller at a time is told LINK_CACHE_FILL; the rest
+ * wait up to WAIT_MS for it to arrive, then are told LINK_CACHE_PASS.
+ * A caller told LINK_CACHE_FILL must follow with link_cache_put() or
+ * link_cache_abandon().
+ */
+int link_cache_get(link_cache* c, const char* key, size_t keylen,
+		   char** data, size_t* len, int wait_ms)
+{
+  unsigned int hash = hash_key(key, keylen);
+  struct cache_entry* e;
+  long long start = wall_ms(), now;
+  int waits = 0;
+  int i;
+
+  for (;;) {
+    cache_lock(c);
+    now = wall_ms();
+    i = find_entry(c, hash, key, keylen);
+    e = i == CACHE_NIL ? 0 : &c->entry[i];
+
+    if (e != 0 && e->state == ENTRY_VALID) {
+      /* Fresh, or stale while another request gets a new copy. */
+      if (now < e->fresh_until
+	  || (now < e->stale_until && e->filling != 0
+	      && now - e->filling < wait_ms)) {
+	*data = (char*) malloc(e->len ? e->len : 1);
+	if (*data == 0) {
+	  cache_unlock(c);
+	  return LINK_CACHE_PASS;
+	}
+	chain_io(c, e->block, e->keylen, *data, e->len, CHAIN_READ);
+	*len = e->len;
+	lru_unlink(c, i);
+	lru_push(c, i);
+	if (now < e->fresh_until)
+	  c->head->hits++;
+	else
+	  c->head->stale_hits++;
+	cache_unlock(c);
+	return LINK_CACHE_HIT;
+      }
+
+      /* Past its use, or stale with nobody getting a new copy. */
+      if (now >= e->stale_until)
+	e->state = ENTRY_PENDING;
+      e->filling = now;
+      c->head->fills++;
+      cache_unlock(c);
+      return LINK_CACHE_FILL;
+    }
+
+    if (e != 0 && e->state == ENTRY_PASS) {
+      if (now < e->stale_until) {
+	c->head->passes++;
+	cache_unlock(c);
+	return LINK_CACHE_PASS;
+      }
+      e->state = ENTRY_PENDING;
+      e->filling = now;
+      c->head->fills++;
+      cache_unlock(c);
+      return LINK_CACHE_FILL;
+    }
+
+    if (e != 0) {
+      /* Another request is getting it; take over if it's been too long. */
+      if (now - e->filling >= wait_ms) {
+	e->filling = now;
+	c->head->fills++;
+	cache_unlock(c);
+	return LINK_CACHE_FILL;
+      }
+      if (now - start >= wait_ms) {
+	c->head->passes++;
+	cache_unlock(c);
+	return LINK_CACHE_PASS;
+      }
+      cache_unlock(c);
+      link_pause_ms(link_backoff_ms(waits++, 20));
+      continue;
+    }
+
+    i = new_entry(c, hash, key, keylen, now);
+    if (i == CACHE_NIL) {
+      c->head->passes++;
+      cache_unlock(c);
+      return LINK_CACHE_PASS;
+    }
+    c->head->fills++;
+    cache_unlock(c);
+    return LINK_CACHE_FILL;
+  }
+}
+
+/* Store the page with KEY, fresh for FRESH_MS and then usable while
+ * a new copy is got for STALE_MS more.
+ */
+void link_cache_put(link_cache* c, const char* key, size_t keylen,
+		    const char* data, size_t len, long fresh_ms,
+		    long stale_ms)
+{
+  unsigned int hash = hash_key(key, keylen);
+  struct cache_entry* e;
+  long long now;
+  int i;
+
+  cache_lock(c);
+  now = wall_ms();
+  i = find_entry(c, hash, key, keylen);
+  if (i == CACHE_NIL)
+    i = new_entry(c, hash, key, keylen, now);
+  if (i == CACHE_NIL) {
+    cache_unlock(c);
+    return;
+  }
+  e = &c->entry[i];
+
+  free_chain(c, e->block);
+  e->block = alloc_chain(c, keylen + len, i);
+  if (e->block == CACHE_NIL) {
+    drop_entry(c, i);		/* too big to keep */
+    cache_unlock(c);
+    return;
+  }
+  chain_io(c, e->block, 0, (char*) key, keylen, CHAIN_WRITE);
+  chain_io(c, e->block, keylen, (char*) data, len, CHAIN_WRITE);
+  e->len = len;
+  e->fresh_until = now + fresh_ms;
+  e->stale_until = e->fresh_until + (stale_ms > 0 ? stale_ms : 0);
+  e->filling = 0;
+  e->state = ENTRY_VALID;
+  lru_unlink(c, i);
+  lru_push(c, i);
+  c->head->stores++;
+  cache_unlock(c);
+}
+
+/* The caller told LINK_CACHE_FILL won't be storing the page after
+ * all.  For a while requests for it go straight to the server, or
+ * if there is a stale copy it stays in use until another request
+ * tries again.
+ */
+void link_cache_abandon(link_cache* c, const char* key, size_t keylen)
+{
+  unsigned int hash = hash_key(key, keylen);
+  int i;
+
+  cache_lock(c);
+  i = find_entry(c, hash, key, keylen);
+  if (i != CACHE_NIL) {
+    if (c->entry[i].state == ENTRY_PENDING) {
+      c->entry[i].state = ENTRY_PASS;
+      c->entry[i].stale_until = wall_ms() + CACHE_PASS_MS;
+    }
+    c->entry[i].filling = 0;
+  }
+  cache_unlock(c);
+}
+
+/* Does the Cookie header COOKIES have one of the space-separated
+ * NAMES, such as the session cookie?
+ */
+int link_cache_cookie(const char* cookies, const char* names)
+{
+  const char* n;
+  const char* p;
+  size_t len;
+
+  if (cookies == 0 || names == 0)
+    return 0;
+  for (n = names; *n; n += len) {
+    while (*n == ' ')
+      n++;
+    for (len = 0; n[len] && n[len] != ' '; len++)
+      ;
+    if (len == 0)
+      break;
+    for (p = cookies; *p; p++) {
+      while (*p == ' ' || *p == ';')
+	p++;
+      if (strncmp(p, n, len) == 0 && p[len] == '=')
+	return 1;
+      while (*p && *p != ';')
+	p++;
+      if (*p == '\0')
+	break;
+    }
+  }
+  return 0;
+}
+
+static int header_is(const char* line, const char* name)
+{
+  size_t len = strlen(name);
+
+  return strncasecmp(line, name, len) == 0 && line[len] == ':';
+}
+
+static const char* header_value(const char* line, const char* name)
+{
+  line += strlen(name) + 1;
+  while (*line == ' ' || *line == '\t')
+    line++;
+  return line;
+}
+
+/* The number of seconds given by the Cache-Control directive NAME,
+ * or -1.
+ */
+static long cc_seconds(const char* v, const char* name)
+{
+  size_t len = strlen(name);
+  const char* p;
+
+  for (p = v; (p = strstr(p, name)) != 0; p += len)
+    if ((p == v || p[-1] == ' ' || p[-1] == ',') && p[len] == '=')
+      return atol(p + len + 1);
+  return -1;
+}
+
+/* Seconds since 1970 of an HTTP date such as "Sun, 06 Nov 1994
+ * 08:49:37 GMT", or -1.
+ */
+static long long http_date(const char* s)
+{
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char mon[4];
+  const char* m;
+  int d, y, hh, mm, ss;
+  long long days;
+
+  s = strchr(s, ',');
+  if (s == 0
+      || sscanf(s + 1, "%d %3s %d %d:%d:%d", &d, mon, &y, &hh, &mm, &ss) != 6
+      || (m = strstr(months, mon)) == 0 || (m - months) % 3 != 0)
+    return -1;
+
+  /* Days from the civil date, with March as the first month. */
+  {
+    int month = (int) (m - months) / 3 + 1;
+    int yy = y - (month <= 2);
+    int era = (yy >= 0 ? yy : yy - 399) / 400;
+    int yoe = yy - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    days = (long long) era * 146097 + doe - 719468;
+  }
+  return days * 86400 + hh * 3600 + mm * 60 + ss;
+}
+
+/* How many ms the page in DATA, as the server sent it, may be kept
+ * for, or 0 if it may not be cached: it must be a 200 response setting
+ * no cookies and saying how long it is good for.  If it says how long
+ * it may be used while stale, that is returned in STALE_MS, otherwise
+ * STALE_MS is set to -1.
+ */
+long link_cache_lifetime(const char* data, size_t len, long* stale_ms)
+{
+  const char* line;
+  const char* end;
+  const char* v;
+  char hdr[1024];
+  long long expires = -1;
+  long accel = -1, max_age = -1, s_maxage = -1;
+  int status = 200;
+  size_t n;
+
+  *stale_ms = -1;
+  for (line = data; line < data + len; line = end + 1) {
+    end = memchr(line, '\n', data + len - line);
+    if (end == 0)
+      return 0;			/* the headers don't all fit */
+    n = end - line;
+    if (n > 0 && line[n - 1] == '\r')
+      n--;
+    if (n == 0)
+      break;
+    if (n >= sizeof(hdr))
+      n = sizeof(hdr) - 1;
+    memcpy(hdr, line, n);
+    hdr[n] = '\0';
+
+    if (line == data && strncmp(hdr, "HTTP/", 5) == 0 && strchr(hdr, ' '))
+      status = atoi(strchr(hdr, ' ') + 1);
+    else if (header_is(hdr, "Status"))
+      status = atoi(header_value(hdr, "Status"));
+    else if (header_is(hdr, "Set-Cookie"))
+      return 0;
+    else if (header_is(hdr, "Pragma")) {
+      if (strstr(header_value(hdr, "Pragma"), "no-cache"))
+	return 0;
+    }
+    else if (header_is(hdr, "Cache-Control")) {
+      v = header_value(hdr, "Cache-Control");
+      if (strstr(v, "no-store") || strstr(v, "no-cache")
+	  || strstr(v, "private"))
+	return 0;
+      s_maxage = cc_seconds(v, "s-maxage");
+      max_age = cc_seconds(v, "max-age");
+      if (cc_seconds(v, "stale-while-revalidate") >= 0)
+	*stale_ms = cc_seconds(v, "stale-while-revalidate") * 1000;
+    }
+    else if (header_is(hdr, "X-Accel-Expires")) {
+      v = header_value(hdr, "X-Accel-Expires");
+      if (*v == '@')
+	accel = atol(v + 1) - (long) time(0);
+      else
+	accel = atol(v);
+      if (accel <= 0)
+	return 0;
+    }
+    else if (header_is(hdr, "Expires"))
+      expires = http_date(header_value(hdr, "Expires"));
+  }
+
+  if (status != 200)
+    return 0;
+  if (accel > 0)
+    return accel * 1000;
+  if (s_maxage >= 0)
+    return s_maxage * 1000;
+  if (max_age >= 0)
+    return max_age * 1000;
+  if (expires > (long long) time(0))
+    return (long) (expires - time(0)) * 1000;
+  return 0;
+}
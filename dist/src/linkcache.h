@@ -0,0 +1,49 @@
+/*
+ * linkcache.h: page cache shared by the link programs and mod_interchange
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+#ifndef LINKCACHE_H
+#define LINKCACHE_H
+
+#include <stddef.h>
+
+/* What link_cache_get() found.
+ */
+#define LINK_CACHE_HIT	1	/* a copy of the page is returned */
+#define LINK_CACHE_FILL	2	/* the caller is to get the page and store it */
+#define LINK_CACHE_PASS	3	/* the caller is to get the page, not storing it */
+
+/* Pages, as the server sent them, in a file mapped by every process
+ * that shares the cache.
+ */
+typedef struct link_cache link_cache;
+
+link_cache* link_cache_open(const char* file, long size);
+int link_cache_get(link_cache* c, const char* key, size_t keylen,
+		   char** data, size_t* len, int wait_ms);
+void link_cache_put(link_cache* c, const char* key, size_t keylen,
+		    const char* data, size_t len, long fresh_ms, long stale_ms);
+void link_cache_abandon(link_cache* c, const char* key, size_t keylen);
+
+int link_cache_cookie(const char* cookies, const char* names);
+long link_cache_lifetime(const char* data, size_t len, long* stale_ms);
+
+#endif /* LINKCACHE_H */
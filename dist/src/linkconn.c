@@ -0,0 +1,300 @@
+/*
+ * linkconn.c: connecting to the Interchange server, shared by the link
+ * programs and mod_interchange
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+/* A connect that fails is retried after a short delay that doubles
+ * each time, with jitter so that a crowd of waiting requests doesn't
+ * hit a restarting server in lockstep.
+ *
+ * The circuit breaker remembers, for every process that maps the same
+ * file, that a server is refusing connections.  Once enough connects
+ * in a row have been refused it opens, and new requests are turned
+ * away at once for the cooldown period instead of each waiting to find
+ * out.  Requests that were already trying go on, and the first to
+ * connect closes it.  After the cooldown a single request is let
+ * through to try the server; it closes the breaker if it connects and
+ * reopens it if it doesn't.
+ *
+ * The file holds a small table of servers, found by name (see
+ * linktable.c), so that one file can serve every link program and
+ * Apache child on the host.  It is created on first use; if it can't
+ * be opened or mapped the breaker is simply not used.
+ *
+ * The failures in a row and the time the breaker stays open until are
+ * kept in one word, so that a failure and a success can't interleave
+ * and lose one or the other: each is a compare-and-swap of the whole.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "linkconn.h"
+#include "linktable.h"
+
+#define BREAKER_MAGIC	0x49434232	/* "ICB2" */
+#define BREAKER_SLOTS	64
+#define BREAKER_NAME	112
+
+/* The breaker word holds the failures in a row in its top bits and,
+ * in the low OPEN_BITS bits, the time in ms it is open until, or 0
+ * while it is closed.
+ */
+#define OPEN_BITS	48
+#define OPEN_MASK	((1ULL << OPEN_BITS) - 1)
+#define MAX_FAILURES	0xffff
+#define FAILURES(w)	((int) ((w) >> OPEN_BITS))
+#define OPEN_UNTIL(w)	((long long) ((w) & OPEN_MASK))
+#define BREAKER(failures, until) \
+  (((unsigned long long) (failures) << OPEN_BITS) \
+   | ((unsigned long long) (until) & OPEN_MASK))
+
+struct breaker_slot {
+  volatile int state;
+  volatile unsigned long long breaker;	/* failures and open until */
+  volatile long long probe_at;		/* trial request started, ms */
+  char name[BREAKER_NAME];
+};
+
+static const struct link_table breaker_table = {
+  BREAKER_MAGIC, BREAKER_SLOTS, sizeof(struct breaker_slot),
+  offsetof(struct breaker_slot, name), BREAKER_NAME
+};
+
+struct link_breaker {
+  struct breaker_slot* slot;
+  int failures;				/* failures that open the breaker */
+  int cooldown;				/* ms it stays open */
+};
+
+/* Milliseconds on a clock that all processes on the host share and
+ * that doesn't jump when the time of day is set.
+ */
+long long link_now_ms(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+  {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+  }
+}
+
+/* Connect FD to SA, waiting no more than TIMEOUT_MS for the server to
+ * accept.  Returns 0, leaving FD blocking, or -1 with errno set.
+ */
+int link_connect(int fd, const struct sockaddr* sa, socklen_t size,
+		 int timeout_ms)
+{
+  struct pollfd pfd;
+  long long deadline;
+  socklen_t len;
+  int flags;
+  int err;
+  int n;
+
+  flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    return -1;
+
+  if (connect(fd, sa, size) == 0)
+    goto connected;
+  if (errno != EINPROGRESS && errno != EINTR)
+    return -1;
+
+  deadline = link_now_ms() + timeout_ms;
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  for (;;) {
+    n = poll(&pfd, 1, (int) (deadline - link_now_ms()));
+    if (n > 0)
+      break;
+    if (n == 0 || link_now_ms() >= deadline) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+    if (errno != EINTR)
+      return -1;
+  }
+
+  len = sizeof(err);
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, (void*) &err, &len) < 0)
+    return -1;
+  if (err) {
+    errno = err;
+    return -1;
+  }
+
+connected:
+  fcntl(fd, F_SETFL, flags);
+  return 0;
+}
+
+/* Did a connect fail with ERR only because the server was busy, its
+ * listen queue full or slow to accept, rather than not there at all?
+ * Such a connect is worth retrying and says nothing about whether the
+ * server is down.
+ */
+int link_connect_busy(int err)
+{
+  return err == EAGAIN || err == EWOULDBLOCK || err == ETIMEDOUT;
+}
+
+/* Delay before retry number ATTEMPT (from 0): doubling from
+ * LINK_BACKOFF_START up to MAX_MS, then a random point in the upper
+ * half of that.
+ */
+int link_backoff_ms(int attempt, int max_ms)
+{
+  static int seeded = 0;
+  int delay = LINK_BACKOFF_START;
+
+  if (!seeded) {
+    srand((unsigned int) (getpid() ^ link_now_ms()));
+    seeded = 1;
+  }
+  while (attempt-- > 0 && delay < max_ms)
+    delay *= 2;
+  if (delay > max_ms)
+    delay = max_ms;
+  return delay / 2 + rand() % (delay / 2 + 1);
+}
+
+void link_pause_ms(int ms)
+{
+  long long deadline = link_now_ms() + ms;
+
+  while (ms > 0) {
+    poll(0, 0, ms);
+    ms = (int) (deadline - link_now_ms());
+  }
+}
+
+/* The breaker for SERVER in FILE, opening after FAILURES failed
+ * connects in a row and staying open for COOLDOWN_MS.  Returns 0 when
+ * there is no usable breaker, which the other calls accept.
+ */
+link_breaker* link_breaker_open(const char* file, const char* server,
+				int failures, int cooldown_ms)
+{
+  struct breaker_slot* slot;
+  link_breaker* b;
+
+  if (file == 0 || *file == '\0' || failures <= 0)
+    return 0;
+
+  slot = (struct breaker_slot*) link_table_find(&breaker_table, file, server);
+  if (slot == 0)
+    return 0;
+  b = (link_breaker*) malloc(sizeof(*b));
+  if (b == 0)
+    return 0;
+  b->slot = slot;
+  b->failures = failures;
+  b->cooldown = cooldown_ms;
+  return b;
+}
+
+/* May a request try the server?  Not while the breaker is open, nor
+ * while another request is making the trial connect after the cooldown.
+ * Returns LINK_BREAKER_TRIAL if this request is to make the trial.
+ */
+int link_breaker_allow(link_breaker* b)
+{
+  struct breaker_slot* s;
+  long long now, until, probe;
+
+  if (b == 0)
+    return 1;
+  s = b->slot;
+  until = OPEN_UNTIL(s->breaker);
+  if (until == 0)
+    return 1;
+  now = link_now_ms();
+  if (now < until)
+    return 0;
+
+  /* A trial that has taken longer than a cooldown is presumed lost.
+   */
+  probe = s->probe_at;
+  if (probe != 0 && now - probe < b->cooldown)
+    return 0;
+  return __sync_bool_compare_and_swap(&s->probe_at, probe, now)
+    ? LINK_BREAKER_TRIAL : 0;
+}
+
+void link_breaker_success(link_breaker* b)
+{
+  struct breaker_slot* s;
+
+  if (b == 0)
+    return;
+  s = b->slot;
+
+  /* Leave the shared line alone in the usual case of nothing to reset.
+   */
+  if (s->breaker == 0)
+    return;
+  __sync_lock_test_and_set(&s->breaker, 0ULL);
+  __sync_lock_test_and_set(&s->probe_at, 0LL);
+}
+
+/* A connect to the server has been refused.  This is counted for each
+ * refusal as it happens, so that the breaker opens soon after the
+ * server goes away, but not for a server that was only busy, so that
+ * a burst of load doesn't open it.
+ */
+void link_breaker_failure(link_breaker* b)
+{
+  struct breaker_slot* s;
+  unsigned long long w;
+  long long until;
+  int n;
+
+  if (b == 0)
+    return;
+  s = b->slot;
+
+  /* Open after too many failures, or again when the trial fails.
+   */
+  do {
+    w = s->breaker;
+    n = FAILURES(w) < MAX_FAILURES ? FAILURES(w) + 1 : MAX_FAILURES;
+    until = OPEN_UNTIL(w);
+    if (n >= b->failures || until != 0)
+      until = link_now_ms() + b->cooldown;
+  } while (!__sync_bool_compare_and_swap(&s->breaker, w,
+					 BREAKER(n, until)));
+  if (until != OPEN_UNTIL(w))
+    __sync_lock_test_and_set(&s->probe_at, 0LL);
+}
@@ -0,0 +1,57 @@
+/*
+ * linkconn.h: connecting to the Interchange server, shared by the link
+ * programs and mod_interchange
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+#ifndef LINKCONN_H
+#define LINKCONN_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* First retry delay, in milliseconds; it doubles on each retry.
+ */
+#define LINK_BACKOFF_START	10
+
+/* What link_breaker_allow() returns, when not 0, for the request that
+ * is to try the server once the breaker's cooldown is over.
+ */
+#define LINK_BREAKER_TRIAL	2
+
+/* Circuit breaker for one server, in a file mapped by every process
+ * talking to it.
+ */
+typedef struct link_breaker link_breaker;
+
+long long link_now_ms(void);
+int link_connect(int fd, const struct sockaddr* sa, socklen_t size,
+		 int timeout_ms);
+int link_connect_busy(int err);
+int link_backoff_ms(int attempt, int max_ms);
+void link_pause_ms(int ms);
+
+link_breaker* link_breaker_open(const char* file, const char* server,
+				int failures, int cooldown_ms);
+int link_breaker_allow(link_breaker* b);
+void link_breaker_success(link_breaker* b);
+void link_breaker_failure(link_breaker* b);
+
+#endif /* LINKCONN_H */
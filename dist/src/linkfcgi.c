@@ -0,0 +1,623 @@
+/*
+ * linkfcgi.c: FastCGI responder for the vlink and tlink link programs
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+/* When a process manager such as mod_fcgid or spawn-fcgi starts a link
+ * program, its stdin is a listening socket instead of the request
+ * entity.  The program then stays resident and answers one request
+ * after another, each relayed to Interchange just as a CGI request
+ * would be, so a page no longer costs a fork and exec.
+ *
+ * Requests are answered one at a time; the web server is told so in
+ * reply to FCGI_GET_VALUES and gets FCGI_CANT_MPX_CONN should it try
+ * to multiplex a connection.  Run more processes for concurrency.
+ */
+
+#include "config.h"
+#include <errno.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "link.h"
+
+#define FCGI_LISTENSOCK_FILENO	0
+#define FCGI_HEADER_LEN		8
+#define FCGI_VERSION_1		1
+
+#define FCGI_BEGIN_REQUEST	1
+#define FCGI_ABORT_REQUEST	2
+#define FCGI_END_REQUEST	3
+#define FCGI_PARAMS		4
+#define FCGI_STDIN		5
+#define FCGI_STDOUT		6
+#define FCGI_GET_VALUES		9
+#define FCGI_GET_VALUES_RESULT	10
+#define FCGI_UNKNOWN_TYPE	11
+
+#define FCGI_RESPONDER		1
+#define FCGI_KEEP_CONN		1
+
+#define FCGI_REQUEST_COMPLETE	0
+#define FCGI_CANT_MPX_CONN	1
+#define FCGI_UNKNOWN_ROLE	3
+
+#define FCGI_CHUNK		32768	/* largest record we send */
+
+struct record {
+  int type;
+  int id;
+  int len;
+  int pad;
+};
+
+static int conn = -1;		/* connection from the web server */
+static int conn_broken;		/* connection failed mid-request */
+static int req_id;		/* request being answered */
+static int keep_conn;		/* leave conn open after the request */
+
+static int stdin_left;		/* bytes left in current FCGI_STDIN record */
+static int stdin_pad;		/* its padding, still to be skipped */
+static int stdin_eof;		/* saw the empty FCGI_STDIN record */
+
+static jmp_buf request_done;	/* bailout from an unfinished request */
+static int request_status;	/* exit status of the request */
+
+static char ibuf[16384];	/* input buffer for conn */
+static int ibuf_pos;
+static int ibuf_len;
+static char obuf[FCGI_HEADER_LEN + FCGI_CHUNK + 8];
+
+static char* params = 0;	/* FCGI_PARAMS stream of the request */
+static int params_len;
+static int params_size;
+static char* env_strings = 0;	/* params turned into NAME=value */
+static int env_strings_size;
+static char** env = 0;		/* pointers into env_strings */
+static int env_size;
+
+/* Memory trouble between requests; there is no client to tell.
+ */
+static void* grow(p, size, need)
+     void* p;
+     int* size;
+     int need;
+{
+  if (need <= *size)
+    return p;
+  while (*size < need)
+    *size = *size ? *size * 2 : 4096;
+  p = realloc(p, *size);
+  if (p == 0) {
+    fprintf(stderr, "link: out of memory for FastCGI request\n");
+    exit(1);
+  }
+  return p;
+}
+
+/* Read exactly LEN bytes from the web server into DST, or skip them
+ * if DST is null.  Returns 0 on end of file or error.
+ */
+static int conn_read(dst, len)
+     char* dst;
+     int len;
+{
+  int n;
+
+  while (len > 0) {
+    if (ibuf_pos == ibuf_len) {
+      do {
+        n = read(conn, ibuf, sizeof(ibuf));
+      } while (n < 0 && errno == EINTR);
+      if (n <= 0)
+        return 0;
+      ibuf_pos = 0;
+      ibuf_len = n;
+    }
+    n = ibuf_len - ibuf_pos;
+    if (n > len)
+      n = len;
+    if (dst != 0) {
+      memcpy(dst, ibuf + ibuf_pos, n);
+      dst += n;
+    }
+    ibuf_pos += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/* Write LEN bytes to the web server.  Returns -1 on error.
+ */
+static int conn_write(src, len)
+     const char* src;
+     int len;
+{
+  int w;
+
+  while (len > 0) {
+    do {
+      w = write(conn, src, len);
+    } while (w < 0 && errno == EINTR);
+    if (w < 0)
+      return -1;
+    src += w;
+    len -= w;
+  }
+  return 0;
+}
+
+static int read_header(rec)
+     struct record* rec;
+{
+  unsigned char h[FCGI_HEADER_LEN];
+
+  if (!conn_read((char*) h, FCGI_HEADER_LEN))
+    return 0;
+  if (h[0] != FCGI_VERSION_1)
+    return 0;
+  rec->type = h[1];
+  rec->id = (h[2] << 8) | h[3];
+  rec->len = (h[4] << 8) | h[5];
+  rec->pad = h[6];
+  return 1;
+}
+
+static int send_record(type, id, data, len)
+     int type;
+     int id;
+     const char* data;
+     int len;
+{
+  int pad = (8 - (len & 7)) & 7;
+
+  obuf[0] = FCGI_VERSION_1;
+  obuf[1] = type;
+  obuf[2] = (id >> 8) & 0xff;
+  obuf[3] = id & 0xff;
+  obuf[4] = (len >> 8) & 0xff;
+  obuf[5] = len & 0xff;
+  obuf[6] = pad;
+  obuf[7] = 0;
+  if (len > 0)
+    memcpy(obuf + FCGI_HEADER_LEN, data, len);
+  memset(obuf + FCGI_HEADER_LEN + len, 0, pad);
+  return conn_write(obuf, FCGI_HEADER_LEN + len + pad);
+}
+
+static int send_end_request(id, app_status, protocol_status)
+     int id;
+     int app_status;
+     int protocol_status;
+{
+  char body[8];
+
+  body[0] = (app_status >> 24) & 0xff;
+  body[1] = (app_status >> 16) & 0xff;
+  body[2] = (app_status >> 8) & 0xff;
+  body[3] = app_status & 0xff;
+  body[4] = protocol_status;
+  body[5] = body[6] = body[7] = 0;
+  return send_record(FCGI_END_REQUEST, id, body, sizeof(body));
+}
+
+/* Decode a name or value length from a name-value pair at P, not
+ * going past END.  Returns -1 if it does not fit.
+ */
+static int pair_length(p, end)
+     unsigned char** p;
+     unsigned char* end;
+{
+  unsigned char* s = *p;
+  int len;
+
+  if (s >= end)
+    return -1;
+  if ((*s & 0x80) == 0) {
+    *p = s + 1;
+    return *s;
+  }
+  if (end - s < 4)
+    return -1;
+  len = ((s[0] & 0x7f) << 24) | (s[1] << 16) | (s[2] << 8) | s[3];
+  *p = s + 4;
+  return len;
+}
+
+static void put_length(p, len)
+     char** p;
+     int len;
+{
+  char* s = *p;
+
+  if (len < 128) {
+    *s++ = len;
+  }
+  else {
+    *s++ = ((len >> 24) & 0x7f) | 0x80;
+    *s++ = (len >> 16) & 0xff;
+    *s++ = (len >> 8) & 0xff;
+    *s++ = len & 0xff;
+  }
+  *p = s;
+}
+
+/* Answer FCGI_GET_VALUES: we take one connection and one request
+ * at a time.
+ */
+static int get_values(len)
+     int len;
+{
+  static char* known[][2] = {
+    { "FCGI_MAX_CONNS", "1" },
+    { "FCGI_MAX_REQS", "1" },
+    { "FCGI_MPXS_CONNS", "0" },
+  };
+  char query[1024];
+  char reply[256];
+  char* r = reply;
+  unsigned char* p;
+  unsigned char* end;
+  int nlen;
+  int vlen;
+  int i;
+
+  if (len > (int) sizeof(query))
+    return conn_read(0, len) ? send_record(FCGI_GET_VALUES_RESULT, 0, 0, 0) : -1;
+  if (!conn_read(query, len))
+    return -1;
+
+  p = (unsigned char*) query;
+  end = p + len;
+  while (p < end) {
+    if ((nlen = pair_length(&p, end)) < 0 || (vlen = pair_length(&p, end)) < 0
+        || end - p < nlen + vlen)
+      break;
+    for (i = 0;  i < (int) (sizeof(known) / sizeof(known[0]));  ++i) {
+      if ((int) strlen(known[i][0]) == nlen
+          && memcmp(p, known[i][0], nlen) == 0
+          && r + 10 + nlen + strlen(known[i][1]) < reply + sizeof(reply)) {
+        put_length(&r, nlen);
+        put_length(&r, strlen(known[i][1]));
+        memcpy(r, known[i][0], nlen);
+        r += nlen;
+        memcpy(r, known[i][1], strlen(known[i][1]));
+        r += strlen(known[i][1]);
+      }
+    }
+    p += nlen + vlen;
+  }
+  return send_record(FCGI_GET_VALUES_RESULT, 0, reply, r - reply);
+}
+
+/* Deal with a record that is not part of the request being answered.
+ * Returns -1 if the connection has failed.
+ */
+static int other_record(rec)
+     struct record* rec;
+{
+  char type[8];
+
+  if (rec->id == 0 && rec->type == FCGI_GET_VALUES) {
+    if (get_values(rec->len) < 0)
+      return -1;
+    return conn_read(0, rec->pad) ? 0 : -1;
+  }
+
+  if (!conn_read(0, rec->len + rec->pad))
+    return -1;
+
+  if (rec->id == 0) {
+    memset(type, 0, sizeof(type));
+    type[0] = rec->type;
+    return send_record(FCGI_UNKNOWN_TYPE, 0, type, sizeof(type));
+  }
+  if (rec->type == FCGI_BEGIN_REQUEST && rec->id != req_id)
+    return send_end_request(rec->id, 0, FCGI_CANT_MPX_CONN);
+  return 0;
+}
+
+/* Wait for the web server to begin a responder request.  Returns 0
+ * when the connection is closed.
+ */
+static int begin_request()
+{
+  struct record rec;
+  unsigned char body[8];
+
+  req_id = 0;
+  for (;;) {
+    if (!read_header(&rec))
+      return 0;
+    if (rec.type == FCGI_BEGIN_REQUEST && rec.id != 0
+        && rec.len == sizeof(body)) {
+      if (!conn_read((char*) body, sizeof(body)) || !conn_read(0, rec.pad))
+        return 0;
+      if (((body[0] << 8) | body[1]) != FCGI_RESPONDER) {
+        if (send_end_request(rec.id, 0, FCGI_UNKNOWN_ROLE) < 0)
+          return 0;
+        continue;
+      }
+      req_id = rec.id;
+      keep_conn = body[2] & FCGI_KEEP_CONN;
+      return 1;
+    }
+    if (other_record(&rec) < 0)
+      return 0;
+  }
+}
+
+/* Collect the FCGI_PARAMS stream and turn it into an environment.
+ * Returns 0 if the connection fails, -1 if the request was aborted.
+ */
+static int read_params()
+{
+  struct record rec;
+  unsigned char* p;
+  unsigned char* end;
+  char* s;
+  int nlen;
+  int vlen;
+  int n;
+
+  params_len = 0;
+  for (;;) {
+    if (!read_header(&rec))
+      return 0;
+    if (rec.id == req_id && rec.type == FCGI_PARAMS) {
+      if (rec.len == 0)
+        break;
+      params = grow(params, &params_size, params_len + rec.len);
+      if (!conn_read(params + params_len, rec.len) || !conn_read(0, rec.pad))
+        return 0;
+      params_len += rec.len;
+      continue;
+    }
+    if (rec.id == req_id && rec.type == FCGI_ABORT_REQUEST) {
+      if (!conn_read(0, rec.len + rec.pad))
+        return 0;
+      return send_end_request(req_id, 0, FCGI_REQUEST_COMPLETE) < 0 ? 0 : -1;
+    }
+    if (other_record(&rec) < 0)
+      return 0;
+  }
+  if (!conn_read(0, rec.pad))
+    return 0;
+
+  /* Every pair takes at least two length bytes, which is room enough
+   * for the '=' and the terminating null.
+   */
+  env_strings = grow(env_strings, &env_strings_size, params_len + 1);
+  s = env_strings;
+  n = 0;
+  p = (unsigned char*) params;
+  end = p + params_len;
+  while (p < end) {
+    if ((nlen = pair_length(&p, end)) < 0 || (vlen = pair_length(&p, end)) < 0
+        || end - p < nlen + vlen)
+      break;
+    env = grow(env, &env_size, (n + 2) * sizeof(char*));
+    env[n++] = s;
+    memcpy(s, p, nlen);
+    s += nlen;
+    *s++ = '=';
+    memcpy(s, p + nlen, vlen);
+    s += vlen;
+    *s++ = '\0';
+    p += nlen + vlen;
+  }
+  env = grow(env, &env_size, (n + 1) * sizeof(char*));
+  env[n] = 0;
+  return 1;
+}
+
+/* Make request entity available in the current FCGI_STDIN record.
+ * Returns 1 if there is some, 0 at the end and -1 if the request
+ * was aborted or the connection failed.
+ */
+static int stdin_ready()
+{
+  struct record rec;
+
+  while (stdin_left == 0) {
+    if (stdin_eof)
+      return 0;
+    if (stdin_pad > 0) {
+      if (!conn_read(0, stdin_pad))
+        return -1;
+      stdin_pad = 0;
+    }
+    if (!read_header(&rec))
+      return -1;
+    if (rec.id == req_id && rec.type == FCGI_STDIN) {
+      if (rec.len == 0)
+        stdin_eof = 1;
+      stdin_left = rec.len;
+      stdin_pad = rec.pad;
+      continue;
+    }
+    if (rec.id == req_id && rec.type == FCGI_ABORT_REQUEST) {
+      conn_read(0, rec.len + rec.pad);
+      return -1;
+    }
+    if (other_record(&rec) < 0)
+      return -1;
+  }
+  return 1;
+}
+
+/* Read up to LEN bytes of request entity.
+ */
+int fcgi_read(buf, len)
+     char* buf;
+     int len;
+{
+  int r;
+
+  r = stdin_ready();
+  if (r < 0) {
+    conn_broken = 1;
+    fcgi_bailout(1);
+  }
+  if (r == 0)
+    return 0;
+  if (len > stdin_left)
+    len = stdin_left;
+  if (!conn_read(buf, len)) {
+    conn_broken = 1;
+    fcgi_bailout(1);
+  }
+  stdin_left -= len;
+  return len;
+}
+
+/* Send LEN bytes of response as FCGI_STDOUT records.  The web server
+ * connection is blocking, so it is all written or the request is
+ * abandoned.
+ */
+int fcgi_write(buf, len)
+     const char* buf;
+     int len;
+{
+  int left = len;
+  int n;
+
+  while (left > 0) {
+    n = left < FCGI_CHUNK ? left : FCGI_CHUNK;
+    if (send_record(FCGI_STDOUT, req_id, buf, n) < 0) {
+      conn_broken = 1;
+      fcgi_bailout(1);
+    }
+    buf += n;
+    left -= n;
+  }
+  return len;
+}
+
+/* Abandon the request being answered.
+ */
+void fcgi_bailout(status)
+     int status;
+{
+  request_status = status;
+  longjmp(request_done, 1);
+}
+
+/* Finish off a request: skip any entity it did not use, close the
+ * response stream and report its status.  The entity is skipped even
+ * if the connection is to be closed, as closing with input unread
+ * resets it and can lose the response on its way to the web server.
+ * Returns 0 if the connection has failed.
+ */
+static int end_request(status)
+     int status;
+{
+  int r;
+
+  while ((r = stdin_ready()) > 0) {
+    if (!conn_read(0, stdin_left))
+      return 0;
+    stdin_left = 0;
+  }
+  if (r < 0)
+    return 0;
+  if (send_record(FCGI_STDOUT, req_id, 0, 0) < 0)
+    return 0;
+  return send_end_request(req_id, status, FCGI_REQUEST_COMPLETE) == 0;
+}
+
+/* Is stdin the listening socket a FastCGI process manager hands us?
+ */
+int fcgi_is_listener()
+{
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+
+  if (getpeername(FCGI_LISTENSOCK_FILENO, (struct sockaddr*) &sa, &len) == 0)
+    return 0;
+  return errno == ENOTCONN;
+}
+
+/* Accept requests from the web server until killed.
+ */
+int fcgi_run(argv)
+     char** argv;
+{
+  char** process_env = environ;
+  int r;
+
+  link_fcgi = 1;
+  for (;;) {
+    if (conn < 0) {
+      do {
+        conn = accept(FCGI_LISTENSOCK_FILENO, 0, 0);
+      } while (conn < 0 && errno == EINTR);
+      if (conn < 0) {
+        perror("link: accept");
+        return 1;
+      }
+      ibuf_pos = ibuf_len = 0;
+    }
+
+    if (!begin_request() || (r = read_params()) == 0) {
+      close(conn);
+      conn = -1;
+      continue;
+    }
+    if (r < 0) {
+      /* Aborted, and already ended: the connection goes on only if the
+       * web server asked for that.
+       */
+      if (!keep_conn) {
+        close(conn);
+        conn = -1;
+      }
+      continue;
+    }
+
+    conn_broken = 0;
+    stdin_left = stdin_pad = stdin_eof = 0;
+    link_client_out = conn;
+    environ = env;
+
+    /* The program arguments are ours, not the request's. */
+    request_status = 0;
+    if (setjmp(request_done) == 0)
+      link_request(1, argv);
+    else
+      link_abandon();	       /* the client went away mid-request */
+
+    environ = process_env;
+    if (sock >= 0) {
+      close(sock);
+      sock = -1;
+    }
+
+    if (conn_broken || !end_request(request_status) || !keep_conn) {
+      close(conn);
+      conn = -1;
+    }
+  }
+}
@@ -0,0 +1,63 @@
+/*
+ * linkstat.c: prints the request timings kept by the link programs
+ *             and mod_interchange
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "linkstats.h"
+
+static void put(line, arg)
+     const char* line;
+     void* arg;
+{
+  fputs(line, (FILE*) arg);
+}
+
+/* Usage: linkstat [file]
+ *
+ * The file is the one given, or that named by MINIVEND_STATS, or the
+ * one the link programs were compiled with.
+ */
+int main(argc, argv)
+     int argc;
+     char** argv;
+{
+  char* file;
+
+  if (argc > 1)
+    file = argv[1];
+  else if ((file = getenv("MINIVEND_STATS")) == 0)
+    file = LINK_STATS;
+  if (*file == '\0') {
+    fprintf(stderr, "usage: linkstat [file]\n"
+	    "the link programs were compiled without a statistics file\n");
+    return 2;
+  }
+
+  if (link_stats_report(file, put, stdout) < 0) {
+    fprintf(stderr, "linkstat: no statistics in '%s'\n", file);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,299 @@
+/*
+ * linkstats.c: request timings shared by the link programs and mod_interchange
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+/* Every request to a server is timed in phases: connecting, sending
+ * the request, waiting for the first of the response, and passing the
+ * response on to the client.  Each phase's time goes into a histogram
+ * for the server and the class of the response status, so that the
+ * median and the slowest requests can be told apart.
+ *
+ * The histograms are in a file mapped by every process, laid out like
+ * the circuit breaker file: a table of servers, found by name (see
+ * linktable.c).  They are only ever added to, with atomic increments,
+ * so no lock is taken and a report can be made at any time.  A process
+ * killed in the middle of a request leaves it counted as in flight.
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "linkstats.h"
+#include "linktable.h"
+
+#define STATS_MAGIC	0x49435331	/* "ICS1" */
+#define STATS_SLOTS	32
+#define STATS_NAME	112
+
+/* Responses are sorted by the first digit of their status, 0 for none.
+ */
+#define STATS_CLASSES	6
+
+/* Eight buckets for every doubling of the time, so that a percentile
+ * is within an eighth of the truth, from 1us up to about seventeen
+ * minutes; the last bucket takes anything longer.
+ */
+#define STATS_SHIFT	3
+#define STATS_STEPS	(1 << STATS_SHIFT)
+#define STATS_BUCKETS	(STATS_STEPS * 28)
+
+struct stats_slot {
+  volatile int state;
+  volatile int in_flight;		/* requests the server has in hand */
+  volatile unsigned int requests;	/* requests it has answered */
+  volatile unsigned int connect_failures;	/* connects that failed */
+  volatile unsigned int turned_away;	/* requests given up on */
+  unsigned int unused;
+  char name[STATS_NAME];
+  volatile unsigned int
+    hist[STATS_CLASSES][LINK_PHASES][STATS_BUCKETS];
+};
+
+static const struct link_table stats_table = {
+  STATS_MAGIC, STATS_SLOTS, sizeof(struct stats_slot),
+  offsetof(struct stats_slot, name), STATS_NAME
+};
+
+struct link_stats {
+  struct stats_slot* slot;
+};
+
+static const char* phase_names[LINK_PHASES] = {
+  "connect", "send", "wait", "drain", "total"
+};
+
+/* Microseconds on a clock that doesn't jump when the time of day is set.
+ */
+long long link_now_us(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+  {
+    struct timeval tv;
+
+    gettimeofday(&tv, 0);
+    return (long long) tv.tv_sec * 1000000 + tv.tv_usec;
+  }
+}
+
+/* The bucket for US microseconds.
+ */
+static int bucket(long long us)
+{
+  int e;
+  int b;
+
+  if (us < STATS_STEPS)
+    return us < 0 ? 0 : (int) us;
+  for (e = STATS_SHIFT; e < 62 && (us >> (e + 1)) != 0; e++)
+    ;
+  b = STATS_STEPS * (e - STATS_SHIFT + 1)
+    + (int) ((us >> (e - STATS_SHIFT)) & (STATS_STEPS - 1));
+  return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+/* The least time, in microseconds, that goes in bucket B.
+ */
+static long long bucket_floor(int b)
+{
+  int e;
+
+  if (b < STATS_STEPS)
+    return b;
+  e = b / STATS_STEPS + STATS_SHIFT - 1;
+  return (long long) (STATS_STEPS + b % STATS_STEPS) << (e - STATS_SHIFT);
+}
+
+/* The statistics for SERVER in FILE.  Returns 0 when there are none to
+ * keep, which the other calls accept.
+ */
+link_stats* link_stats_open(const char* file, const char* server)
+{
+  struct stats_slot* slot;
+  link_stats* s;
+
+  if (file == 0 || *file == '\0')
+    return 0;
+
+  slot = (struct stats_slot*) link_table_find(&stats_table, file, server);
+  if (slot == 0)
+    return 0;
+  s = (link_stats*) malloc(sizeof(*s));
+  if (s == 0)
+    return 0;
+  s->slot = slot;
+  return s;
+}
+
+/* A request has been connected to the server.
+ */
+void link_stats_begin(link_stats* s)
+{
+  if (s != 0)
+    __sync_add_and_fetch(&s->slot->in_flight, 1);
+}
+
+/* The request begun has been answered with STATUS, or 0 if there was
+ * no answer, its phases taking PHASE_US; a phase it never reached is
+ * given as -1.
+ */
+void link_stats_end(link_stats* s, int status, const long long* phase_us)
+{
+  int c = status >= 100 && status < 600 ? status / 100 : 0;
+  int i;
+
+  if (s == 0)
+    return;
+  for (i = 0; i < LINK_PHASES; i++)
+    if (phase_us[i] >= 0)
+      __sync_add_and_fetch(&s->slot->hist[c][i][bucket(phase_us[i])], 1);
+  __sync_add_and_fetch(&s->slot->requests, 1);
+  __sync_sub_and_fetch(&s->slot->in_flight, 1);
+}
+
+void link_stats_connect_failed(link_stats* s)
+{
+  if (s != 0)
+    __sync_add_and_fetch(&s->slot->connect_failures, 1);
+}
+
+/* A request is being answered with an error page without having been
+ * sent to the server.
+ */
+void link_stats_turned_away(link_stats* s)
+{
+  if (s != 0)
+    __sync_add_and_fetch(&s->slot->turned_away, 1);
+}
+
+/* The status of a response from the first LEN bytes of it, DATA: that
+ * given by a Status header or an HTTP status line, otherwise 200.
+ */
+int link_stats_status(const char* data, size_t len)
+{
+  const char* line;
+  const char* end;
+  size_t n;
+
+  for (line = data; line < data + len; line = end + 1) {
+    end = memchr(line, '\n', data + len - line);
+    if (end == 0)
+      break;
+    n = end - line;
+    if (n > 0 && line[n - 1] == '\r')
+      n--;
+    if (n == 0)
+      break;
+    if (line == data && n > 9 && strncmp(line, "HTTP/", 5) == 0
+	&& memchr(line, ' ', n))
+      return atoi((char*) memchr(line, ' ', n) + 1);
+    if (n > 7 && strncasecmp(line, "Status:", 7) == 0)
+      return atoi(line + 7);
+  }
+  return 200;
+}
+
+/* The time, in ms, below which PCT percent of the COUNT requests in
+ * histogram H fall.
+ */
+static double percentile(volatile unsigned int* h, unsigned long count,
+			 int pct)
+{
+  unsigned long want = (count * pct + 99) / 100;
+  unsigned long seen = 0;
+  int b;
+
+  for (b = 0; b < STATS_BUCKETS - 1; b++) {
+    seen += h[b];
+    if (seen >= want)
+      break;
+  }
+  return bucket_floor(b + 1) / 1000.0;
+}
+
+/* Describe the statistics in FILE, a line at a time, to PUT.  Returns
+ * -1 if there are none.
+ */
+int link_stats_report(const char* file,
+		      void (*put)(const char* line, void* arg), void* arg)
+{
+  static const char* classes[STATS_CLASSES] = {
+    "none", "1xx", "2xx", "3xx", "4xx", "5xx"
+  };
+  struct stats_slot* s;
+  void* map;
+  unsigned long count;
+  char line[256];
+  size_t n;
+  int i, c, p, b;
+
+  if (file == 0 || *file == '\0'
+      || (map = link_table_map(&stats_table, file, 0)) == 0)
+    return -1;
+
+  for (i = 0; i < STATS_SLOTS; i++) {
+    s = (struct stats_slot*) link_table_slot(&stats_table, map, i);
+    if (s == 0)
+      continue;
+    snprintf(line, sizeof(line), "server %s\n", s->name);
+    put(line, arg);
+    snprintf(line, sizeof(line),
+	     "  in flight %d, answered %u, connects failed %u,"
+	     " turned away %u\n",
+	     s->in_flight, s->requests, s->connect_failures, s->turned_away);
+    put(line, arg);
+
+    for (c = 0; c < STATS_CLASSES; c++) {
+      count = 0;
+      for (b = 0; b < STATS_BUCKETS; b++)
+	count += s->hist[c][LINK_PHASE_TOTAL][b];
+      if (count == 0)
+	continue;
+      snprintf(line, sizeof(line), "  %-4s %8lu requests, ms p50/p99:",
+	       classes[c], count);
+      for (p = 0; p < LINK_PHASES; p++) {
+	count = 0;
+	for (b = 0; b < STATS_BUCKETS; b++)
+	  count += s->hist[c][p][b];
+	if (count == 0)
+	  continue;
+	n = strlen(line);
+	snprintf(line + n, sizeof(line) - n, " %s %.1f/%.1f", phase_names[p],
+		 percentile(s->hist[c][p], count, 50),
+		 percentile(s->hist[c][p], count, 99));
+      }
+      n = strlen(line);
+      snprintf(line + n, sizeof(line) - n, "\n");
+      put(line, arg);
+    }
+  }
+  link_table_unmap(&stats_table, map);
+  return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * linkstats.h: request timings shared by the link programs and mod_interchange
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+#ifndef LINKSTATS_H
+#define LINKSTATS_H
+
+#include <stddef.h>
+
+/* The phases of a request, each timed in microseconds.
+ */
+#define LINK_PHASE_CONNECT	0	/* connecting, retries and all */
+#define LINK_PHASE_SEND		1	/* sending the request */
+#define LINK_PHASE_WAIT		2	/* waiting for the first of the response */
+#define LINK_PHASE_DRAIN	3	/* passing the response to the client */
+#define LINK_PHASE_TOTAL	4
+#define LINK_PHASES		5
+
+/* Counts and timings for one server, in a file mapped by every process
+ * talking to it.
+ */
+typedef struct link_stats link_stats;
+
+long long link_now_us(void);
+
+link_stats* link_stats_open(const char* file, const char* server);
+void link_stats_begin(link_stats* s);
+void link_stats_end(link_stats* s, int status, const long long* phase_us);
+void link_stats_connect_failed(link_stats* s);
+void link_stats_turned_away(link_stats* s);
+
+int link_stats_status(const char* data, size_t len);
+int link_stats_report(const char* file,
+		      void (*put)(const char* line, void* arg), void* arg);
+
+#endif /* LINKSTATS_H */
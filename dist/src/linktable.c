@@ -0,0 +1,224 @@
+/*
+ * linktable.c: tables of servers in files mapped by every process, shared
+ * by the circuit breaker and the request timings
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+/* A table is a small header followed by a fixed number of slots, one
+ * for each server, found by name.  Every link program and Apache child
+ * on the host maps the same file, so that they share what each slot
+ * holds.  A new file is all zeros, which is an empty table.
+ *
+ * Finding a server's slot takes no lock, as a slot once named keeps
+ * its name.  Naming a free slot is done under a lock in the header, so
+ * that two processes adding the same server at once can't each name
+ * one and split its counts between them.  A lock left by a process
+ * that has died is taken over.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "linktable.h"
+
+#define SLOT_FREE	0
+#define SLOT_CLAIMED	1		/* name being written */
+#define SLOT_READY	2
+
+struct table_head {
+  volatile unsigned int magic;
+  volatile unsigned int lock;		/* pid of the process naming a slot */
+};
+
+static size_t table_size(const struct link_table* t)
+{
+  return sizeof(struct table_head) + t->slots * t->slot_size;
+}
+
+static volatile int* slot_state(const struct link_table* t, void* map, int i)
+{
+  return (volatile int*) ((char*) map + sizeof(struct table_head)
+			  + i * t->slot_size);
+}
+
+static char* slot_name(const struct link_table* t, void* map, int i)
+{
+  return (char*) slot_state(t, map, i) + t->name_offset;
+}
+
+/* Map FILE, creating it if need be, or only if it exists when reading.
+ * Returns 0 if it can't be used.
+ */
+void* link_table_map(const struct link_table* t, const char* file,
+		     int create)
+{
+  struct table_head* map;
+  struct stat st;
+  size_t size = table_size(t);
+  int fd;
+
+  fd = open(file, create ? O_RDWR | O_CREAT : O_RDONLY, 0666);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) < 0
+      || (st.st_size < (off_t) size
+	  && (!create || ftruncate(fd, size) < 0))) {
+    close(fd);
+    return 0;
+  }
+  map = (struct table_head*) mmap(0, size,
+				  create ? PROT_READ | PROT_WRITE : PROT_READ,
+				  MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == (struct table_head*) MAP_FAILED)
+    return 0;
+
+  if (create)
+    __sync_bool_compare_and_swap(&map->magic, 0, t->magic);
+  if (map->magic != t->magic) {
+    munmap((void*) map, size);
+    return 0;
+  }
+  return (void*) map;
+}
+
+void link_table_unmap(const struct link_table* t, void* map)
+{
+  munmap(map, table_size(t));
+}
+
+/* Slot I of MAP, or 0 if no server has it.
+ */
+void* link_table_slot(const struct link_table* t, void* map, int i)
+{
+  if (*slot_state(t, map, i) != SLOT_READY)
+    return 0;
+  return (void*) slot_state(t, map, i);
+}
+
+static void* lookup(const struct link_table* t, void* map,
+		    const char* server)
+{
+  int i;
+
+  for (i = 0; i < t->slots; i++)
+    if (*slot_state(t, map, i) == SLOT_READY
+	&& strncmp(slot_name(t, map, i), server, t->name_size - 1) == 0)
+      return (void*) slot_state(t, map, i);
+  return 0;
+}
+
+static void table_lock(struct table_head* h)
+{
+  unsigned int me = getpid();
+  unsigned int owner;
+  int spins;
+
+  for (spins = 1; ; spins++) {
+    owner = h->lock;
+    if (owner == 0 && __sync_bool_compare_and_swap(&h->lock, 0, me))
+      return;
+    if (owner != 0 && spins % 256 == 0 && kill((pid_t) owner, 0) < 0
+	&& errno == ESRCH && __sync_bool_compare_and_swap(&h->lock, owner, me))
+      return;
+    if (spins < 64)
+      sched_yield();
+    else
+      poll(0, 0, 1);
+  }
+}
+
+/* Find the slot for SERVER, naming a free one if it has none.  Another
+ * process may have named one while this waited for the lock, so look
+ * again once it is held.  A slot left claimed was being named by a
+ * process that died holding the lock, and is free.
+ */
+static void* find_slot(const struct link_table* t, void* map,
+		       const char* server)
+{
+  struct table_head* h = (struct table_head*) map;
+  volatile int* state;
+  char* name;
+  void* slot;
+  int i;
+
+  slot = lookup(t, map, server);
+  if (slot != 0)
+    return slot;
+
+  table_lock(h);
+  slot = lookup(t, map, server);
+  for (i = 0; slot == 0 && i < t->slots; i++) {
+    state = slot_state(t, map, i);
+    if (*state == SLOT_READY)
+      continue;
+    *state = SLOT_CLAIMED;
+    name = slot_name(t, map, i);
+    strncpy(name, server, t->name_size - 1);
+    name[t->name_size - 1] = '\0';
+    __sync_synchronize();
+    *state = SLOT_READY;
+    slot = (void*) state;
+  }
+  __sync_lock_release(&h->lock);
+  return slot;
+}
+
+/* The slot for SERVER in the table in FILE.  Returns 0 when there is
+ * no usable slot.
+ */
+void* link_table_find(const struct link_table* t, const char* file,
+		      const char* server)
+{
+  static struct mapped {
+    struct mapped* next;
+    const struct link_table* table;
+    void* map;
+    char file[1];
+  }* mapped = 0;
+  struct mapped* m;
+
+  /* Slots stay valid, so each file is mapped once and kept.
+   */
+  for (m = mapped; m; m = m->next)
+    if (m->table == t && strcmp(m->file, file) == 0)
+      break;
+  if (m == 0) {
+    m = (struct mapped*) malloc(sizeof(*m) + strlen(file));
+    if (m == 0)
+      return 0;
+    m->table = t;
+    strcpy(m->file, file);
+    m->map = link_table_map(t, file, 1);
+    m->next = mapped;
+    mapped = m;
+  }
+  if (m->map == 0)
+    return 0;
+  return find_slot(t, m->map, server);
+}
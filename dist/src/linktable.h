@@ -0,0 +1,49 @@
+/*
+ * linktable.h: tables of servers in files mapped by every process, shared
+ * by the circuit breaker and the request timings
+ *
+ * Copyright (C) 2005-2022 Interchange Development Group,
+ * https://www.interchangecommerce.org/
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA.
+ */
+
+#ifndef LINKTABLE_H
+#define LINKTABLE_H
+
+#include <stddef.h>
+
+/* The layout of a table: SLOTS slots of SLOT_SIZE bytes, each starting
+ * with its state, a volatile int, and holding the server's name in
+ * NAME_SIZE bytes at NAME_OFFSET.  MAGIC marks a file as holding it.
+ */
+struct link_table {
+  unsigned int magic;
+  int slots;
+  size_t slot_size;
+  size_t name_offset;
+  size_t name_size;
+};
+
+void* link_table_find(const struct link_table* t, const char* file,
+		      const char* server);
+
+void* link_table_map(const struct link_table* t, const char* file,
+		     int create);
+void* link_table_slot(const struct link_table* t, void* map, int i);
+void link_table_unmap(const struct link_table* t, void* map);
+
+#endif /* LINKTABLE_H */
@@ -1,4 +1,4 @@
-#define	MODULE_VERSION	"mod_interchange/1.33"
+#define	MODULE_VERSION	"mod_interchange/2.0"
 /*
  *	Apache Module implementation of the Interchange application server's
  *	link programs.
@@ -29,23 +29,68 @@
  *	Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
  *	02110-1301 USA.
  */
+
+/*
+ *	This is the Apache 2.4 version of the module.  It is thread-safe,
+ *	so it can be used with the worker and event MPMs as well as prefork.
+ *
+ *	The request body is streamed to Interchange as it arrives, and the
+ *	response is handed to Apache's output filters as a socket bucket,
+ *	so neither is ever held in memory whole.  Once Interchange has
+ *	finished, the event MPM can complete a slow client's write without
+ *	tying up a worker thread.
+ *
+ *	Interchange closes its end of the connection after every response,
+ *	so a connection can't be used for a second request.  What each
+ *	child keeps between requests is each server's address and circuit
+ *	breaker.
+ *
+ *	Requests are shared among any number of servers, each going to the
+ *	one with the fewest requests in hand for its weight.  The counts
+ *	are kept in shared memory, so they cover every child, and a server
+ *	may be given a limit beyond which requests wait in a short queue
+ *	rather than overloading it.  The parent checks each server's health
+ *	from time to time by requesting a page, and a server that doesn't
+ *	answer is left out until it does.
+ */
 #include "httpd.h"
 #include "http_config.h"
 #include "http_core.h"
 #include "http_log.h"
 #include "http_main.h"
 #include "http_protocol.h"
+#include "http_request.h"
 #include "util_script.h"
+#include "ap_mpm.h"
+#include "mpm_common.h"
+#include "apr_atomic.h"
+#include "apr_buckets.h"
+#include "apr_hash.h"
+#include "apr_lib.h"
+#include "apr_network_io.h"
+#include "apr_portable.h"
+#include "apr_shm.h"
+#include "apr_strings.h"
+#if APR_HAS_THREADS
+#include "apr_thread_mutex.h"
+#endif
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 
-#ifdef	OSX
-typedef long socklen_t;
-#endif
+#include "linkconn.h"
+#include "linkcache.h"
+#include "linkstats.h"
 
 #ifndef	AF_LOCAL
 #define	AF_LOCAL	AF_UNIX
@@ -61,29 +106,93 @@ typedef long socklen_t;
 
 #define	IC_DEFAULT_PORT			7786
 #define	IC_DEFAULT_ADDR			"127.0.0.1"
-#define	IC_DEFAULT_TIMEOUT		10
 #define	IC_DEFAULT_CONNECT_TRIES	10
 #define	IC_DEFAULT_CONNECT_RETRY_DELAY	2
+#define	IC_DEFAULT_CONNECT_TIMEOUT	1000
+#define	IC_DEFAULT_BREAKER_FAILURES	10
+#define	IC_DEFAULT_BREAKER_COOLDOWN	5000
+#define	IC_DEFAULT_PROTOCOL		1
+#define	IC_DEFAULT_QUEUE_TIMEOUT	5000
+#define	IC_DEFAULT_PROBE_INTERVAL	5000
+#define	IC_DEFAULT_PROBE_TIMEOUT	1000
+#define	IC_DEFAULT_CACHE_SIZE		67108864
+#define	IC_DEFAULT_CACHE_MAX_PAGE	1048576
+#define	IC_DEFAULT_CACHE_WAIT		2000
+#define	IC_DEFAULT_CACHE_COOKIE		"MV_SESSION_ID"
 
 #define	IC_MAX_DROPLIST			10
 #define	IC_MAX_ORDINARYLIST		10
 #define	IC_MAX_LIST_ENTRYSIZE		40
-#define	IC_MAX_SERVERS			2
 #define	IC_CONFIG_STRING_LEN		100
+#define	IC_BODY_READ_SIZE		65536
+#define	IC_QUEUE_POLL			50	/* most ms between looks for a free server */
+#define	IC_PROBE_FAILURES		2	/* failed probes before a server is left out */
+#define	IC_PROBE_BUF_SIZE		512
+#define	IC_PROBE_AGENT			"mod_interchange-probe"
+#define	IC_PROBE_WAIT			100	/* most ms the parent waits on probes each time */
+#define	IC_CACHE_READ_SIZE		16384
 
-module MODULE_VAR_EXPORT interchange_module;
+/*
+ *	binary link protocol (InterchangeProtocol 2): a preamble, then
+ *	frames of a type byte, a 32-bit big-endian length and the payload
+ */
+#define	IC_FRAME_PREAMBLE		"\0ICL\2"
+#define	IC_FRAME_PREAMBLE_LEN		5
+#define	IC_FRAME_ARGS			'A'
+#define	IC_FRAME_ENV			'E'
+#define	IC_FRAME_ENTITY			'B'
+#define	IC_FRAME_END			'Z'
+
+module AP_MODULE_DECLARE_DATA interchange_module;
+
+#ifdef	APLOG_USE_MODULE
+APLOG_USE_MODULE(interchange);
+#endif
 
 typedef struct ic_socket_struct{
 	struct sockaddr *sockaddr; /* socket to the Interchange server */
 	int family;		/* the socket family in use */
 	socklen_t size;		/* the size of the socket structure */
 	char *address;		/* human-readable form of the address */
+	int backup;		/* only used when no primary server is up */
+	int weight;		/* share of the requests, relative to the others */
+	unsigned int max_active;/* most requests in hand at once, 0 for no limit */
+	int slot;		/* entry in the shared counts, -1 for none */
+	link_breaker *breaker;	/* shared record of the server being down */
+	int breaker_opened;	/* breaker looked up in this child */
+	link_stats *timings;	/* shared request timings */
+	int timings_opened;	/* timings looked up in this child */
 }ic_socket_rec;
 
 typedef struct ic_conf_struct{
-	ic_socket_rec *server[IC_MAX_SERVERS];	/* connection to IC server(s) */
+	apr_array_header_t *servers;	/* IC servers, as (ic_socket_rec *) */
+	int servers_set;	/* InterchangeServer has replaced the default */
+	unsigned int queue_size;/* requests that may wait for a busy server */
+	int queue_timeout;	/* ms a request may wait */
+	int queue_slot;		/* entry in the shared queue counts, -1 for none */
+	char *probe_path;	/* page requested to check a server's health */
+	int probe_interval;	/* ms between checks */
+	int probe_timeout;	/* ms to wait for an answer */
+	int registered;		/* on the ic_confs list */
+	struct ic_conf_struct *next;	/* next on the ic_confs list */
 	int connect_tries;	/* number of times to ret to connect to IC */
-	int connect_retry_delay;/* delay this many seconds between retries */
+	int connect_retry_delay;/* delay at most this many seconds between retries */
+	int connect_timeout;	/* wait this many ms for each connect */
+	char *breaker_file;	/* circuit breaker file shared with the links */
+	int breaker_failures;	/* failed connects that open the breaker */
+	int breaker_cooldown;	/* ms the breaker then stays open */
+	char *cache_file;	/* page cache shared with the link programs */
+	long cache_size;	/* bytes of pages it holds */
+	apr_size_t cache_max_page;	/* largest page it will keep */
+	apr_array_header_t *cache_key;	/* headers the pages vary by, as (ic_cache_header) */
+	char *cache_cookies;	/* cookies, space-separated, that stop a request using the cache */
+	int cache_cookies_set;	/* InterchangeCacheCookie has replaced the default */
+	int cache_stale;	/* ms a page may be used past its lifetime */
+	int cache_wait;		/* ms to wait for a page another request is getting */
+	link_cache *cache;	/* the cache, once opened in this child */
+	int cache_opened;	/* cache looked up in this child */
+	char *stats_file;	/* request timings shared with the links */
+	int protocol;		/* link protocol to speak to IC */
 	int droplist_no;	/* number of entries in the "drop list" */
 	int ordinarylist_no;	/* number of entries in the "ordinary file list" */
 	int location_len;	/* length of the configured <Location> path */
@@ -93,33 +202,527 @@ typedef struct ic_conf_struct{
 	char ordinarylist[IC_MAX_ORDINARYLIST][IC_MAX_LIST_ENTRYSIZE+1];
 }ic_conf_rec;
 
-typedef struct ic_response_buffer_struct{
-	int buff_size;
-	int pos;
-	char buff[MAX_STRING_LEN];
-}ic_response_buffer;
-
-static void ic_initialise(server_rec *,pool *);
-static void *ic_create_dir_config(pool *,char *);
-static const char *ic_server_cmd(cmd_parms *,void *,const char *);
-static const char *ic_serverbackup_cmd(cmd_parms *,void *,const char *);
-static const char *ic_server_setup(cmd_parms *,void *,int,const char *arg);
+/*
+ *	a request header that cached pages vary by
+ */
+typedef struct ic_cache_header_struct{
+	const char *header;	/* its name in the request */
+	const char *env;	/* its name as a CGI variable, as in the cache key */
+}ic_cache_header;
+
+/*
+ *	the timing of a request to an Interchange server
+ */
+typedef struct ic_timing_struct{
+	link_stats *stats;	/* where it is recorded */
+	long long start;	/* when the request began, in microseconds */
+	long long phase_start;	/* when the current phase began */
+	long long phase_us[LINK_PHASES];	/* each phase, -1 if not reached */
+	int status;		/* the response status, 0 for none */
+}ic_timing_rec;
+
+/*
+ *	a page being got from the Interchange server for the cache
+ */
+typedef struct ic_cache_fill_struct{
+	link_cache *cache;
+	const char *key;
+	apr_size_t keylen;
+	apr_socket_t *sock;	/* the Interchange server's socket */
+	char *buf;		/* the copy of the page so far, NULL once given up */
+	apr_size_t size;	/* bytes allocated to buf */
+	apr_size_t got;		/* bytes copied into buf */
+	apr_size_t max_page;	/* largest page the cache will keep */
+	int stale;		/* ms the page may be used past its lifetime */
+	int done;		/* stored or abandoned */
+}ic_cache_fill;
+
+/*
+ *	the parent's record of each server address, for the health probes
+ */
+typedef struct ic_slot_struct{
+	ic_socket_rec *sock_rec;	/* the server */
+	int slot;		/* its entry in the shared counts */
+	char *probe;		/* the probe request, NULL for none */
+	apr_size_t probe_len;
+	int probe_interval;	/* ms between probes */
+	int probe_timeout;	/* ms to wait for an answer */
+	long long probe_due;	/* when to send the next one */
+	int failures;		/* probes failed in a row */
+	int fd;			/* socket of the probe in progress */
+	apr_size_t sent,got;	/* bytes of it sent, and answer received */
+	long long deadline;	/* when it will have failed */
+	char buf[IC_PROBE_BUF_SIZE];	/* the start of the answer */
+	struct ic_slot_struct *next;
+}ic_slot_rec;
+
+/*
+ *	counts shared by all the children, one entry for each server address
+ */
+typedef struct ic_server_stat_struct{
+	apr_uint32_t active;	/* requests the server has in hand */
+	apr_uint32_t down;	/* failed its health probes */
+}ic_server_stat;
+
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *ic_mutex;	/* guards the breakers in a child */
+#endif
+static ic_conf_rec *ic_confs;	/* locations with servers, queues or probes */
+static ic_slot_rec *ic_slots;	/* one for each server address */
+static ic_slot_rec **ic_probing;	/* probes in progress */
+static int ic_nprobing;
+static struct pollfd *ic_probe_pfd;
+static apr_uint32_t *ic_rotor;	/* where the next search for a server starts */
+static ic_server_stat *ic_stats;	/* shared counts for each server */
+static apr_uint32_t *ic_waiting;	/* shared count of each queue */
+static apr_uint32_t *ic_children;	/* a pid for each child, then what it holds of each count */
+static apr_uint32_t *ic_held;	/* this child's part of ic_children */
+static int ic_nchildren;	/* entries in ic_children */
+static int ic_nservers;		/* counts in ic_stats */
+static int ic_ncounts;		/* counts each child holds, servers then queues */
+
+static int ic_pre_config(apr_pool_t *,apr_pool_t *,apr_pool_t *);
+static int ic_initialise(apr_pool_t *,apr_pool_t *,apr_pool_t *,server_rec *);
+static void ic_probe_setup(apr_pool_t *,ic_conf_rec *,ic_slot_rec *);
+static void ic_child_init(apr_pool_t *,server_rec *);
+static void ic_reclaim(server_rec *);
+static int ic_probe_start(ic_slot_rec *,long long);
+static int ic_probe_status(const char *);
+static int ic_probe_step(ic_slot_rec *);
+static void ic_probe_result(server_rec *,ic_slot_rec *,int);
+static int ic_monitor(apr_pool_t *,server_rec *);
+static void *ic_create_dir_config(apr_pool_t *,char *);
+static void ic_register_conf(ic_conf_rec *);
+static const char *ic_server_cmd(cmd_parms *,void *,const char *,const char *,const char *);
+static const char *ic_serverbackup_cmd(cmd_parms *,void *,const char *,const char *,const char *);
+static const char *ic_server_add(cmd_parms *,void *,int,const char *,const char *,const char *);
+static const char *ic_server_setup(cmd_parms *,ic_socket_rec *,const char *arg);
 static const char *ic_connecttries_cmd(cmd_parms *,void *,const char *);
 static const char *ic_connectretrydelay_cmd(cmd_parms *,void *,const char *);
-static BUFF *ic_connect(request_rec *,ic_conf_rec *);
-static int ic_select(int,int,int,int);
-static int ic_send_request(request_rec *,ic_conf_rec *,BUFF *);
-static int ic_transfer_response(request_rec *,BUFF *);
+static const char *ic_connecttimeout_cmd(cmd_parms *,void *,const char *);
+static const char *ic_breaker_cmd(cmd_parms *,void *,const char *,const char *,const char *);
+static const char *ic_protocol_cmd(cmd_parms *,void *,const char *);
+static const char *ic_queue_cmd(cmd_parms *,void *,const char *,const char *);
+static const char *ic_probe_cmd(cmd_parms *,void *,const char *,const char *,const char *);
+static const char *ic_cache_cmd(cmd_parms *,void *,const char *,const char *,const char *);
+static const char *ic_cachekey_cmd(cmd_parms *,void *,const char *);
+static const char *ic_cachecookie_cmd(cmd_parms *,void *,const char *);
+static const char *ic_cachestale_cmd(cmd_parms *,void *,const char *);
+static const char *ic_cachewait_cmd(cmd_parms *,void *,const char *);
+static const char *ic_stats_cmd(cmd_parms *,void *,const char *);
+static void ic_log_reason(const char *,request_rec *);
+static link_breaker *ic_breaker(ic_conf_rec *,ic_socket_rec *);
+static link_stats *ic_timings(ic_conf_rec *,ic_socket_rec *);
+static ic_timing_rec *ic_timing_begin(request_rec *,ic_conf_rec *,ic_socket_rec *,long long);
+static void ic_timing_phase(ic_timing_rec *,int);
+static apr_status_t ic_timing_end(void *);
+static void ic_finished(request_rec *,ic_socket_rec *,ic_timing_rec *);
+static int ic_reserve(ic_socket_rec *);
+static apr_status_t ic_release(void *);
+static int ic_choose(ic_conf_rec *,const char *,int *);
+static int ic_queue_wait(request_rec *,ic_conf_rec *,int *,long long *,int);
+static apr_status_t ic_close_socket(void *);
+static apr_socket_t *ic_connect(request_rec *,ic_conf_rec *,ic_socket_rec **);
+static apr_status_t ic_send_brigade(apr_socket_t *,apr_bucket_brigade *,int *);
+static void ic_put_frame(apr_bucket_brigade *,int,apr_uint32_t);
+static void ic_put_string(apr_bucket_brigade *,const char *,apr_uint32_t);
+static int ic_send_request(request_rec *,ic_conf_rec *,apr_socket_t *);
+static link_cache *ic_cache(ic_conf_rec *);
+static int ic_cacheable(request_rec *,ic_conf_rec *);
+static char *ic_cache_key(request_rec *,ic_conf_rec *);
+static void ic_discard_response(apr_bucket_brigade *);
+static void ic_fill_copy(ic_cache_fill *,const char *,apr_size_t);
+static void ic_fill_end(ic_cache_fill *,int);
+static apr_status_t ic_fill_cleanup(void *);
+static void ic_fill_bucket_destroy(void *);
+static apr_status_t ic_fill_bucket_read(apr_bucket *,const char **,apr_size_t *,apr_read_type_e);
+static apr_status_t ic_fill_bucket_setaside(apr_bucket *,apr_pool_t *);
+static apr_status_t ic_fill_bucket_copy(apr_bucket *,apr_bucket **);
+static apr_bucket *ic_fill_bucket_create(ic_cache_fill *,apr_bucket_alloc_t *);
+static apr_bucket_brigade *ic_fill_cache(request_rec *,ic_conf_rec *,apr_socket_t *,ic_cache_fill *);
+static int ic_relay_response(request_rec *,apr_bucket_brigade *,ic_socket_rec *,ic_timing_rec *);
+static int ic_transfer_response(request_rec *,ic_conf_rec *,apr_socket_t *,ic_socket_rec *,ic_cache_fill *,ic_timing_rec *);
 static int ic_handler(request_rec *);
+static void ic_status_put(const char *,void *);
+static int ic_status_handler(request_rec *);
+static void ic_register_hooks(apr_pool_t *);
+
+/*
+ *	ic_pre_config()
+ *	---------------
+ *	Forget the locations found when the configuration was last read.
+ */
+static int ic_pre_config(apr_pool_t *p,apr_pool_t *plog,apr_pool_t *ptemp)
+{
+	ic_confs = NULL;
+	ic_slots = NULL;
+	return OK;
+}
 
 /*
  *	ic_initialise()
  *	---------------
  *	Module initialisation.
+ *	Gives each server address a slot in the shared counts, and each
+ *	location with a queue a count of its waiting requests, then sets
+ *	up the shared memory for the children to inherit.  Each child
+ *	also notes there what it holds of the counts, so that the parent
+ *	can give back what a child that dies was holding.
+ */
+static int ic_initialise(apr_pool_t *p,apr_pool_t *plog,apr_pool_t *ptemp,server_rec *s)
+{
+	apr_hash_t *slots = apr_hash_make(ptemp);
+	apr_shm_t *shm;
+	ic_conf_rec *conf_rec;
+	ic_socket_rec *sock_rec;
+	ic_slot_rec *slot;
+	apr_size_t size;
+	void *base;
+	int i,nservers = 0,nqueues = 0,threads,limit;
+
+	ap_add_version_component(p,MODULE_VERSION);
+
+	/*
+	 *	a waiting request holds its worker thread, or its whole
+	 *	process under prefork, so a queue must leave some free
+	 */
+	if (ap_mpm_query(AP_MPMQ_MAX_THREADS,&threads) != APR_SUCCESS || threads < 1)
+		threads = 1;
+	if (threads > 1)
+		limit = threads - 1;
+	else if (ap_mpm_query(AP_MPMQ_MAX_DAEMONS,&limit) != APR_SUCCESS || --limit < 0)
+		limit = 0;
+	if (ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS,&ic_nchildren) != APR_SUCCESS || ic_nchildren < 1)
+		ic_nchildren = 1;
+
+	/*
+	 *	leave room for children that have started before the ones
+	 *	they replace have been given back
+	 */
+	ic_nchildren *= 2;
+
+	for (conf_rec = ic_confs; conf_rec; conf_rec = conf_rec->next){
+		if (conf_rec->queue_size > (unsigned int)limit){
+			ap_log_error(APLOG_MARK,APLOG_WARNING,0,s,"mod_interchange: InterchangeQueue %u for /%s is more than the %d requests a child can wait with, so using %d",conf_rec->queue_size,conf_rec->location,limit,limit);
+			conf_rec->queue_size = limit;
+		}
+		conf_rec->queue_slot = conf_rec->queue_size ? nqueues++ : -1;
+		for (i = 0; i < conf_rec->servers->nelts; i++){
+			sock_rec = ((ic_socket_rec **)conf_rec->servers->elts)[i];
+			slot = (ic_slot_rec *)apr_hash_get(slots,sock_rec->address,APR_HASH_KEY_STRING);
+			if (!slot){
+				slot = (ic_slot_rec *)apr_pcalloc(p,sizeof(ic_slot_rec));
+				slot->sock_rec = sock_rec;
+				slot->slot = nservers++;
+				slot->fd = -1;
+				slot->next = ic_slots;
+				ic_slots = slot;
+				apr_hash_set(slots,sock_rec->address,APR_HASH_KEY_STRING,slot);
+			}
+			sock_rec->slot = slot->slot;
+			if (conf_rec->probe_path && !slot->probe)
+				ic_probe_setup(p,conf_rec,slot);
+		}
+	}
+	ic_probing = (ic_slot_rec **)apr_pcalloc(p,(nservers + 1) * sizeof(ic_slot_rec *));
+	ic_probe_pfd = (struct pollfd *)apr_pcalloc(p,(nservers + 1) * sizeof(struct pollfd));
+
+	ic_nservers = nservers;
+	ic_ncounts = nservers + nqueues;
+	size = sizeof(apr_uint32_t) + nservers * sizeof(ic_server_stat) + nqueues * sizeof(apr_uint32_t)
+		+ ic_nchildren * (ic_ncounts + 1) * sizeof(apr_uint32_t);
+	if (apr_shm_create(&shm,size,NULL,p) == APR_SUCCESS){
+		base = apr_shm_baseaddr_get(shm);
+	}else{
+		ap_log_error(APLOG_MARK,APLOG_WARNING,0,s,"mod_interchange: no shared memory, so each child counts only its own requests to the Interchange servers");
+		base = apr_palloc(p,size);
+	}
+	memset(base,0,size);
+	ic_rotor = (apr_uint32_t *)base;
+	ic_stats = (ic_server_stat *)(ic_rotor + 1);
+	ic_waiting = (apr_uint32_t *)(ic_stats + nservers);
+	ic_children = ic_waiting + nqueues;
+	return OK;
+}
+
+/*
+ *	ic_probe_setup()
+ *	----------------
+ *	Make up the health probe for a server, a plain GET request
+ *	for the location's probe page in the text link protocol
+ */
+static void ic_probe_setup(apr_pool_t *p,ic_conf_rec *conf_rec,ic_slot_rec *slot)
+{
+	const char *env[5];
+	char *script;
+	int i;
+
+	if (conf_rec->script_name[0])
+		script = conf_rec->script_name;
+	else
+		script = apr_pstrcat(p,"/",conf_rec->location,NULL);
+
+	env[0] = "REQUEST_METHOD=GET";
+	env[1] = "SERVER_PROTOCOL=HTTP/1.0";
+	env[2] = apr_pstrcat(p,"SCRIPT_NAME=",script,NULL);
+	env[3] = apr_pstrcat(p,"PATH_INFO=",conf_rec->probe_path,NULL);
+	env[4] = "HTTP_USER_AGENT=" IC_PROBE_AGENT;
+
+	slot->probe = apr_psprintf(p,"arg 0\nenv %d\n",5);
+	for (i = 0; i < 5; i++)
+		slot->probe = apr_psprintf(p,"%s%" APR_SIZE_T_FMT " %s\n",slot->probe,strlen(env[i]),env[i]);
+	slot->probe = apr_pstrcat(p,slot->probe,"end\n",NULL);
+	slot->probe_len = strlen(slot->probe);
+	slot->probe_interval = conf_rec->probe_interval;
+	slot->probe_timeout = conf_rec->probe_timeout;
+}
+
+/*
+ *	ic_child_init()
+ *	---------------
+ *	Per-child initialisation.
+ *	Claims an entry in the shared memory for what this child holds
+ *	of the servers' and queues' counts.
  */
-static void ic_initialise(server_rec *s,pool *p)
+static void ic_child_init(apr_pool_t *p,server_rec *s)
 {
-	ap_add_version_component(MODULE_VERSION);
+	apr_uint32_t *entry;
+	int i;
+
+	for (i = 0; ic_ncounts && i < ic_nchildren; i++){
+		entry = ic_children + i * (ic_ncounts + 1);
+		if (apr_atomic_cas32(entry,(apr_uint32_t)getpid(),0) == 0){
+			ic_held = entry + 1;
+			break;
+		}
+	}
+	if (ic_ncounts && !ic_held)
+		ap_log_error(APLOG_MARK,APLOG_WARNING,0,s,"mod_interchange: no room to note what this child holds of the Interchange servers' counts, so they will not be given back if it dies");
+#if APR_HAS_THREADS
+	if (apr_thread_mutex_create(&ic_mutex,APR_THREAD_MUTEX_DEFAULT,p) != APR_SUCCESS){
+		ap_log_error(APLOG_MARK,APLOG_ERR,0,s,"mod_interchange: could not create the child mutex");
+		ic_mutex = NULL;
+	}
+#endif
+}
+
+/*
+ *	ic_probe_start()
+ *	----------------
+ *	Start connecting to a server to probe it, without waiting.
+ *	Returns 0 if the probe is under way, or else its result as
+ *	ic_probe_step() does.  A server too busy to take the connection
+ *	at once is up, as it is to the circuit breaker
+ */
+static int ic_probe_start(ic_slot_rec *slot,long long now)
+{
+	ic_socket_rec *sock_rec = slot->sock_rec;
+	int fd,busy;
+
+	fd = socket(sock_rec->family,SOCK_STREAM,0);
+	if (fd < 0)
+		return -1;
+	if (fcntl(fd,F_SETFL,fcntl(fd,F_GETFL,0) | O_NONBLOCK) < 0
+	    || (connect(fd,sock_rec->sockaddr,sock_rec->size) < 0 && errno != EINPROGRESS)){
+		busy = link_connect_busy(errno);
+		close(fd);
+		return busy ? 1 : -1;
+	}
+	slot->fd = fd;
+	slot->sent = 0;
+	slot->got = 0;
+	slot->deadline = now + slot->probe_timeout;
+	return 0;
+}
+
+/*
+ *	ic_probe_status()
+ *	-----------------
+ *	Judge a server by the headers of its answer to a probe, which
+ *	passes unless it has a 5xx status
+ */
+static int ic_probe_status(const char *buf)
+{
+	const char *line,*next;
+	int status = HTTP_OK;
+
+	for (line = buf; *line; line = next){
+		if (*line == '\r' || *line == '\n')
+			break;
+		if ((next = strchr(line,'\n')) == NULL)
+			next = line + strlen(line);
+		else
+			next++;
+		if (line == buf && strncmp(line,"HTTP/",5) == 0 && strchr(line,' '))
+			status = atoi(strchr(line,' ') + 1);
+		else if (strncasecmp(line,"Status:",7) == 0)
+			status = atoi(line + 7);
+	}
+	return status < 500 ? 1 : -1;
+}
+
+/*
+ *	ic_probe_step()
+ *	---------------
+ *	Carry on with a probe whose socket is ready.  Returns 1 if the
+ *	server has passed, -1 if it has failed and 0 if it isn't done
+ */
+static int ic_probe_step(ic_slot_rec *slot)
+{
+	ssize_t n;
+
+	/*
+	 *	a failed connect shows up as an error on the first write
+	 */
+	if (slot->sent < slot->probe_len){
+		n = write(slot->fd,slot->probe + slot->sent,slot->probe_len - slot->sent);
+		if (n < 0)
+			return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+		slot->sent += n;
+		return 0;
+	}
+
+	/*
+	 *	read until the end of the headers, or as much of them
+	 *	as will fit
+	 */
+	n = read(slot->fd,slot->buf + slot->got,sizeof(slot->buf) - 1 - slot->got);
+	if (n < 0)
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	if (n == 0)
+		return slot->got ? ic_probe_status(slot->buf) : -1;
+	slot->got += n;
+	slot->buf[slot->got] = '\0';
+	if (slot->got == sizeof(slot->buf) - 1 || strstr(slot->buf,"\n\n") || strstr(slot->buf,"\r\n\r\n"))
+		return ic_probe_status(slot->buf);
+	return 0;
+}
+
+/*
+ *	ic_probe_result()
+ *	-----------------
+ *	Leave out a server that has failed its last few probes, and bring
+ *	it back when it passes one
+ */
+static void ic_probe_result(server_rec *s,ic_slot_rec *slot,int passed)
+{
+	ic_server_stat *stat = &ic_stats[slot->slot];
+
+	if (passed){
+		slot->failures = 0;
+		if (apr_atomic_xchg32(&stat->down,0))
+			ap_log_error(APLOG_MARK,APLOG_NOTICE,0,s,"mod_interchange: Interchange server %s passed its health probe and is back in use",slot->sock_rec->address);
+	}else if (++slot->failures >= IC_PROBE_FAILURES){
+		if (!apr_atomic_xchg32(&stat->down,1))
+			ap_log_error(APLOG_MARK,APLOG_WARNING,0,s,"mod_interchange: Interchange server %s failed its health probe and will not be sent requests",slot->sock_rec->address);
+	}
+}
+
+/*
+ *	ic_reclaim()
+ *	------------
+ *	Give back what each child that has gone was holding of the
+ *	servers' and queues' counts, and free its entry.  A child that
+ *	exits normally holds nothing, but one that dies in the middle of
+ *	a request would otherwise leave it counted for good.
+ */
+static void ic_reclaim(server_rec *s)
+{
+	apr_uint32_t *entry,pid,n,lost;
+	int i,k;
+
+	for (i = 0; ic_ncounts && i < ic_nchildren; i++){
+		entry = ic_children + i * (ic_ncounts + 1);
+		pid = apr_atomic_read32(entry);
+		if (!pid || kill((pid_t)pid,0) == 0 || errno != ESRCH)
+			continue;
+		for (k = 0,lost = 0; k < ic_ncounts; k++){
+			n = apr_atomic_xchg32(&entry[k + 1],0);
+			if (!n)
+				continue;
+			if (k < ic_nservers){
+				apr_atomic_sub32(&ic_stats[k].active,n);
+				lost += n;
+			}else{
+				apr_atomic_sub32(&ic_waiting[k - ic_nservers],n);
+			}
+		}
+		if (lost)
+			ap_log_error(APLOG_MARK,APLOG_WARNING,0,s,"mod_interchange: child %u died with %u requests to Interchange in hand, which are no longer counted",pid,lost);
+		apr_atomic_set32(entry,0);
+	}
+}
+
+/*
+ *	ic_monitor()
+ *	------------
+ *	Give back the counts held by children that have died, and probe
+ *	the health of each server that is due, from the parent, which
+ *	calls this about once a second.  The probes run side by side and
+ *	without blocking, and the parent waits on them for no more than
+ *	IC_PROBE_WAIT ms each time, so as not to hold up its upkeep of
+ *	the children; a probe not done by then carries on next time.
+ *
+ *	A server that takes longer than the probe timeout to answer is
+ *	busy rather than down, as link_connect_busy() has it, and so is
+ *	left in use
+ */
+static int ic_monitor(apr_pool_t *p,server_rec *s)
+{
+	ic_slot_rec *slot;
+	long long now = link_now_ms(),until = now + IC_PROBE_WAIT,wait;
+	int i,done,ready;
+
+	ic_reclaim(s);
+
+	for (slot = ic_slots; slot; slot = slot->next){
+		if (!slot->probe || slot->fd >= 0 || now < slot->probe_due)
+			continue;
+		slot->probe_due = now + slot->probe_interval;
+		if ((done = ic_probe_start(slot,now)) == 0)
+			ic_probing[ic_nprobing++] = slot;
+		else
+			ic_probe_result(s,slot,done > 0);
+	}
+
+	while (ic_nprobing){
+		wait = until - now;
+		for (i = 0; i < ic_nprobing; i++){
+			slot = ic_probing[i];
+			ic_probe_pfd[i].fd = slot->fd;
+			ic_probe_pfd[i].events = slot->sent < slot->probe_len ? POLLOUT : POLLIN;
+			ic_probe_pfd[i].revents = 0;
+			if (slot->deadline - now < wait)
+				wait = slot->deadline - now;
+		}
+		ready = poll(ic_probe_pfd,ic_nprobing,wait > 0 ? (int)wait : 0);
+		if (ready < 0 && errno != EINTR)
+			ready = -2;
+		now = link_now_ms();
+
+		for (i = 0; i < ic_nprobing; ){
+			slot = ic_probing[i];
+			done = 0;
+			if (ready == -2)
+				done = -1;
+			else if (ic_probe_pfd[i].revents)
+				done = ic_probe_step(slot);
+			if (!done && now >= slot->deadline)
+				done = 1;
+			if (!done){
+				i++;
+				continue;
+			}
+			close(slot->fd);
+			slot->fd = -1;
+			ic_probe_result(s,slot,done > 0);
+			ic_probing[i] = ic_probing[--ic_nprobing];
+			ic_probe_pfd[i] = ic_probe_pfd[ic_nprobing];
+		}
+		if (now >= until)
+			break;
+	}
+	return OK;
 }
 
 /*
@@ -130,19 +733,19 @@ static void ic_initialise(server_rec *s,pool *p)
  *	which can be overridden using the module's configuration
  *	directives
  */
-static void *ic_create_dir_config(pool *p,char *dir)
+static void *ic_create_dir_config(apr_pool_t *p,char *dir)
 {
 	struct sockaddr_in *inet_sock;
-	int tmp;
+	ic_socket_rec *sock_rec;
 
-	ic_conf_rec *conf_rec = (ic_conf_rec *)ap_pcalloc(p,sizeof(ic_conf_rec));
+	ic_conf_rec *conf_rec = (ic_conf_rec *)apr_pcalloc(p,sizeof(ic_conf_rec));
 	if (conf_rec == NULL)
 		return NULL;
 
 	/*
 	 *	the default connection method is INET to localhost
 	 */
-	inet_sock = (struct sockaddr_in *)ap_pcalloc(p,sizeof(struct sockaddr_in));
+	inet_sock = (struct sockaddr_in *)apr_pcalloc(p,sizeof(struct sockaddr_in));
 	if (inet_sock == NULL)
 		return NULL;
 
@@ -150,17 +753,19 @@ static void *ic_create_dir_config(pool *p,char *dir)
 	inet_aton(IC_DEFAULT_ADDR,&inet_sock->sin_addr);
 	inet_sock->sin_port = htons(IC_DEFAULT_PORT);
 
-	conf_rec->server[0] = (ic_socket_rec *)ap_pcalloc(p,sizeof(ic_socket_rec));
-	if (conf_rec->server[0] == NULL)
+	sock_rec = (ic_socket_rec *)apr_pcalloc(p,sizeof(ic_socket_rec));
+	if (sock_rec == NULL)
 		return NULL;
 
-	conf_rec->server[0]->sockaddr = (struct sockaddr *)inet_sock;
-	conf_rec->server[0]->size = sizeof (struct sockaddr_in);
-	conf_rec->server[0]->family = PF_INET;
-	conf_rec->server[0]->address = IC_DEFAULT_ADDR;
+	sock_rec->sockaddr = (struct sockaddr *)inet_sock;
+	sock_rec->size = sizeof (struct sockaddr_in);
+	sock_rec->family = PF_INET;
+	sock_rec->address = IC_DEFAULT_ADDR;
+	sock_rec->weight = 1;
+	sock_rec->slot = -1;
 
-	for (tmp = 1; tmp < IC_MAX_SERVERS; tmp++)
-		conf_rec->server[tmp] = (ic_socket_rec *)NULL;
+	conf_rec->servers = apr_array_make(p,2,sizeof(ic_socket_rec *));
+	*(ic_socket_rec **)apr_array_push(conf_rec->servers) = sock_rec;
 
 	if (dir){
 		/*
@@ -188,20 +793,44 @@ static void *ic_create_dir_config(pool *p,char *dir)
 	}
 	conf_rec->connect_tries = IC_DEFAULT_CONNECT_TRIES;
 	conf_rec->connect_retry_delay = IC_DEFAULT_CONNECT_RETRY_DELAY;
+	conf_rec->connect_timeout = IC_DEFAULT_CONNECT_TIMEOUT;
+	conf_rec->protocol = IC_DEFAULT_PROTOCOL;
+	conf_rec->queue_timeout = IC_DEFAULT_QUEUE_TIMEOUT;
+	conf_rec->queue_slot = -1;
+	conf_rec->probe_interval = IC_DEFAULT_PROBE_INTERVAL;
+	conf_rec->probe_timeout = IC_DEFAULT_PROBE_TIMEOUT;
+	conf_rec->cache_key = apr_array_make(p,2,sizeof(ic_cache_header));
+	conf_rec->cache_cookies = IC_DEFAULT_CACHE_COOKIE;
+	conf_rec->cache_wait = IC_DEFAULT_CACHE_WAIT;
 	conf_rec->droplist_no = 0;
 	conf_rec->ordinarylist_no = 0;
 	conf_rec->script_name[0] = '\0';
 	return conf_rec;
 }
 
+/*
+ *	ic_register_conf()
+ *	------------------
+ *	Note a location that needs shared counts or health probes,
+ *	so that ic_initialise() can set them up
+ */
+static void ic_register_conf(ic_conf_rec *conf_rec)
+{
+	if (conf_rec->registered)
+		return;
+	conf_rec->registered = 1;
+	conf_rec->next = ic_confs;
+	ic_confs = conf_rec;
+}
+
 /*
  *	ic_server_cmd()
  *	---------------
  *	Handle the "InterchangeServer" module configuration directive
  */
-static const char *ic_server_cmd(cmd_parms *parms,void *mconfig,const char *arg)
+static const char *ic_server_cmd(cmd_parms *parms,void *mconfig,const char *arg,const char *opt1,const char *opt2)
 {
-	return ic_server_setup(parms,mconfig,0,arg);
+	return ic_server_add(parms,mconfig,0,arg,opt1,opt2);
 }
 
 /*
@@ -209,31 +838,83 @@ static const char *ic_server_cmd(cmd_parms *parms,void *mconfig,const char *arg)
  *	---------------------
  *	Handle the "InterchangeServerBackup" module configuration directive
  */
-static const char *ic_serverbackup_cmd(cmd_parms *parms,void *mconfig,const char *arg)
+static const char *ic_serverbackup_cmd(cmd_parms *parms,void *mconfig,const char *arg,const char *opt1,const char *opt2)
+{
+	return ic_server_add(parms,mconfig,1,arg,opt1,opt2);
+}
+
+/*
+ *	ic_server_add()
+ *	---------------
+ *	Add a primary or backup server, with its optional "weight=" and
+ *	"max=" settings, on behalf of the ic_server_cmd() and
+ *	ic_serverbackup_cmd() functions.  The first primary server
+ *	replaces the default one.
+ */
+static const char *ic_server_add(cmd_parms *parms,void *mconfig,int backup,const char *arg,const char *opt1,const char *opt2)
 {
 	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+	ic_socket_rec *sock_rec;
+	const char *opts[2],*err;
+	int i;
+
+	sock_rec = (ic_socket_rec *)apr_pcalloc(parms->pool,sizeof(ic_socket_rec));
+	if (sock_rec == NULL)
+		return apr_psprintf(parms->pool,"not enough memory for %s socket record",backup ? "backup" : "primary");
+
+	sock_rec->backup = backup;
+	sock_rec->weight = 1;
+	sock_rec->slot = -1;
+
+	opts[0] = opt1;
+	opts[1] = opt2;
+	for (i = 0; i < 2 && opts[i]; i++){
+		if (strncasecmp(opts[i],"weight=",7) == 0){
+			sock_rec->weight = atoi(opts[i] + 7);
+			if (sock_rec->weight <= 0)
+				return "server weight must be positive";
+		}else if (strncasecmp(opts[i],"max=",4) == 0){
+			if (atoi(opts[i] + 4) < 0)
+				return "server max must not be negative";
+			sock_rec->max_active = atoi(opts[i] + 4);
+		}else{
+			return apr_psprintf(parms->pool,"unknown server option '%s'",opts[i]);
+		}
+	}
+
+	if ((err = ic_server_setup(parms,sock_rec,arg)) != NULL)
+		return err;
+
+	if (!backup && !conf_rec->servers_set){
+		apr_array_header_t *servers = apr_array_make(parms->pool,2,sizeof(ic_socket_rec *));
 
-	conf_rec->server[1] = (ic_socket_rec *)ap_pcalloc(parms->pool,sizeof(ic_socket_rec));
-	if (conf_rec->server[1] == NULL)
-		return "not enough memory for backup socket record";
+		/*
+		 *	drop the default server, keeping any backups
+		 */
+		for (i = 0; i < conf_rec->servers->nelts; i++){
+			ic_socket_rec *old = ((ic_socket_rec **)conf_rec->servers->elts)[i];
 
-	return ic_server_setup(parms,mconfig,1,arg);
+			if (old->backup)
+				*(ic_socket_rec **)apr_array_push(servers) = old;
+		}
+		conf_rec->servers = servers;
+		conf_rec->servers_set = 1;
+	}
+	*(ic_socket_rec **)apr_array_push(conf_rec->servers) = sock_rec;
+	ic_register_conf(conf_rec);
+	return NULL;
 }
 
 /*
  *	ic_server_setup()
  *	-----------------
- *	Do the actual primary/backup server setup on behalf of the
- *	ic_server_cmd() and ic_serverbackup_cmd() functions.
+ *	Set up the address of a primary or backup server
  */
-static const char *ic_server_setup(cmd_parms *parms,void *mconfig,int server,const char *arg)
+static const char *ic_server_setup(cmd_parms *parms,ic_socket_rec *sock_rec,const char *arg)
 {
-	static char errmsg[100];
-
-	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
-	ic_socket_rec *sock_rec = conf_rec->server[server];
+	int server = sock_rec->backup;
 
-	sock_rec->address = ap_pstrdup(parms->pool,arg);
+	sock_rec->address = apr_pstrdup(parms->pool,arg);
 	if (sock_rec->address == NULL)
 		return "not enough memory for the socket address";
 
@@ -248,14 +929,13 @@ static const char *ic_server_setup(cmd_parms *parms,void *mconfig,int server,con
 		 */
 		struct sockaddr_un *unix_sock;
 
-		unix_sock = (struct sockaddr_un *)ap_pcalloc(parms->pool,sizeof(struct sockaddr_un));
+		unix_sock = (struct sockaddr_un *)apr_pcalloc(parms->pool,sizeof(struct sockaddr_un));
 		if (unix_sock == NULL){
-			sprintf(errmsg,"not enough memory for %s UNIX socket structure",server ? "primary" : "backup");
-			return errmsg;
+			return apr_psprintf(parms->pool,"not enough memory for %s UNIX socket structure",server ? "backup" : "primary");
 		}
 
 		unix_sock->sun_family = AF_LOCAL;
-		ap_cpystrn(unix_sock->sun_path,sock_rec->address,sizeof(unix_sock->sun_path));
+		apr_cpystrn(unix_sock->sun_path,sock_rec->address,sizeof(unix_sock->sun_path));
 		sock_rec->sockaddr = (struct sockaddr *)unix_sock;
 		sock_rec->size = SUN_LEN(unix_sock);
 		sock_rec->family = PF_LOCAL;
@@ -267,35 +947,35 @@ static const char *ic_server_setup(cmd_parms *parms,void *mconfig,int server,con
 		 *	an optional port specification
 		 */
 		struct sockaddr_in *inet_sock;
-		char **hostaddress;
+		const char *hostaddress;
 		char *hostname;
 
-		inet_sock = (struct sockaddr_in *)ap_pcalloc(parms->pool,sizeof(struct sockaddr_in));
+		inet_sock = (struct sockaddr_in *)apr_pcalloc(parms->pool,sizeof(struct sockaddr_in));
 		if (inet_sock == NULL){
-			sprintf(errmsg,"not enough memory for %s INET socket structure",server ? "primary" : "backup");
-			return errmsg;
+			return apr_psprintf(parms->pool,"not enough memory for %s INET socket structure",server ? "backup" : "primary");
 		}
 
 		inet_sock->sin_family = AF_INET;
-		hostaddress = &(sock_rec->address);
-		hostname = ap_getword_nc(parms->temp_pool,hostaddress,':');
+		hostaddress = sock_rec->address;
+		hostname = ap_getword(parms->temp_pool,&hostaddress,':');
 
 		if (!inet_aton(hostname,&inet_sock->sin_addr)){
 			/*
 			 *	address must point to a hostname
 			 */
-			struct hostent *host = ap_pgethostbyname(parms->temp_pool,hostname);
-			if (!host)
+			apr_sockaddr_t *host;
+
+			if (apr_sockaddr_info_get(&host,hostname,APR_INET,0,0,parms->temp_pool) != APR_SUCCESS)
 				return "invalid hostname specification";
 
-			memcpy(&inet_sock->sin_addr,host->h_addr,sizeof(inet_sock->sin_addr));
+			memcpy(&inet_sock->sin_addr,&host->sa.sin.sin_addr,sizeof(inet_sock->sin_addr));
 		}
 
 		/*
 		 *	check if a port number has been specified
 		 */
-		if (**hostaddress){
-			int port = atoi(*hostaddress);
+		if (*hostaddress){
+			int port = atoi(hostaddress);
 
 			if (port <= 100 || port > 65535)
 				return "invalid port specification";
@@ -338,6 +1018,191 @@ static const char *ic_connectretrydelay_cmd(cmd_parms *parms,void *mconfig,const
 	return NULL;
 }
 
+/*
+ *	ic_connecttimeout_cmd()
+ *	-----------------------
+ *	Handle the "ConnectTimeout" module configuration directive
+ */
+static const char *ic_connecttimeout_cmd(cmd_parms *parms,void *mconfig,const char *arg)
+{
+	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+
+	conf_rec->connect_timeout = atoi(arg);
+	return NULL;
+}
+
+/*
+ *	ic_breaker_cmd()
+ *	----------------
+ *	Handle the "InterchangeBreaker" module configuration directive
+ */
+static const char *ic_breaker_cmd(cmd_parms *parms,void *mconfig,const char *file,const char *failures,const char *cooldown)
+{
+	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+
+	conf_rec->breaker_file = ap_server_root_relative(parms->pool,file);
+	conf_rec->breaker_failures = failures ? atoi(failures) : IC_DEFAULT_BREAKER_FAILURES;
+	conf_rec->breaker_cooldown = cooldown ? atoi(cooldown) : IC_DEFAULT_BREAKER_COOLDOWN;
+	if (conf_rec->breaker_failures <= 0 || conf_rec->breaker_cooldown <= 0)
+		return "InterchangeBreaker failures and cooldown must be positive";
+	return NULL;
+}
+
+/*
+ *	ic_protocol_cmd()
+ *	-----------------
+ *	Handle the "InterchangeProtocol" module configuration directive
+ */
+static const char *ic_protocol_cmd(cmd_parms *parms,void *mconfig,const char *arg)
+{
+	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+
+	conf_rec->protocol = atoi(arg);
+	if (conf_rec->protocol != 1 && conf_rec->protocol != 2)
+		return "InterchangeProtocol must be 1 or 2";
+	return NULL;
+}
+
+/*
+ *	ic_queue_cmd()
+ *	--------------
+ *	Handle the "InterchangeQueue" module configuration directive
+ */
+static const char *ic_queue_cmd(cmd_parms *parms,void *mconfig,const char *size,const char *timeout)
+{
+	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+
+	if (atoi(size) < 0)
+		return "InterchangeQueue size must not be negative";
+	conf_rec->queue_size = atoi(size);
+	conf_rec->queue_timeout = timeout ? atoi(timeout) : IC_DEFAULT_QUEUE_TIMEOUT;
+	if (conf_rec->queue_timeout <= 0)
+		return "InterchangeQueue timeout must be positive";
+	ic_register_conf(conf_rec);
+	return NULL;
+}
+
+/*
+ *	ic_probe_cmd()
+ *	--------------
+ *	Handle the "InterchangeProbe" module configuration directive
+ */
+static const char *ic_probe_cmd(cmd_parms *parms,void *mconfig,const char *path,const char *interval,const char *timeout)
+{
+	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+
+	if (*path != '/')
+		return "InterchangeProbe page must start with '/'";
+	conf_rec->probe_path = apr_pstrdup(parms->pool,path);
+	conf_rec->probe_interval = interval ? atoi(interval) : IC_DEFAULT_PROBE_INTERVAL;
+	conf_rec->probe_timeout = timeout ? atoi(timeout) : IC_DEFAULT_PROBE_TIMEOUT;
+	if (conf_rec->probe_interval <= 0 || conf_rec->probe_timeout <= 0)
+		return "InterchangeProbe interval and timeout must be positive";
+	ic_register_conf(conf_rec);
+	return NULL;
+}
+
+/*
+ *	ic_cache_cmd()
+ *	--------------
+ *	Handle the "InterchangeCache" module configuration directive
+ */
+static const char *ic_cache_cmd(cmd_parms *parms,void *mconfig,const char *file,const char *size,const char *max_page)
+{
+	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+
+	conf_rec->cache_file = ap_server_root_relative(parms->pool,file);
+	conf_rec->cache_size = size ? atol(size) : IC_DEFAULT_CACHE_SIZE;
+	conf_rec->cache_max_page = max_page ? (apr_size_t)atol(max_page) : IC_DEFAULT_CACHE_MAX_PAGE;
+	if (conf_rec->cache_size <= 0 || conf_rec->cache_max_page <= 0)
+		return "InterchangeCache size and largest page must be positive";
+	return NULL;
+}
+
+/*
+ *	ic_cachekey_cmd()
+ *	-----------------
+ *	Handle the "InterchangeCacheKey" module configuration directive
+ */
+static const char *ic_cachekey_cmd(cmd_parms *parms,void *mconfig,const char *arg)
+{
+	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+	ic_cache_header *hdr;
+	char *env,*cp;
+
+	env = apr_pstrcat(parms->pool,"HTTP_",arg,NULL);
+	for (cp = env; *cp; cp++){
+		if (*cp == '-')
+			*cp = '_';
+		else
+			*cp = apr_toupper(*cp);
+	}
+	hdr = (ic_cache_header *)apr_array_push(conf_rec->cache_key);
+	hdr->header = apr_pstrdup(parms->pool,arg);
+	hdr->env = env;
+	return NULL;
+}
+
+/*
+ *	ic_cachecookie_cmd()
+ *	--------------------
+ *	Handle the "InterchangeCacheCookie" module configuration directive
+ */
+static const char *ic_cachecookie_cmd(cmd_parms *parms,void *mconfig,const char *arg)
+{
+	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+
+	if (!conf_rec->cache_cookies_set){
+		conf_rec->cache_cookies = "";
+		conf_rec->cache_cookies_set = 1;
+	}
+	conf_rec->cache_cookies = apr_pstrcat(parms->pool,conf_rec->cache_cookies," ",arg,NULL);
+	return NULL;
+}
+
+/*
+ *	ic_cachestale_cmd()
+ *	-------------------
+ *	Handle the "InterchangeCacheStale" module configuration directive
+ */
+static const char *ic_cachestale_cmd(cmd_parms *parms,void *mconfig,const char *arg)
+{
+	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+
+	conf_rec->cache_stale = atoi(arg) * 1000;
+	if (conf_rec->cache_stale < 0)
+		return "InterchangeCacheStale must not be negative";
+	return NULL;
+}
+
+/*
+ *	ic_cachewait_cmd()
+ *	------------------
+ *	Handle the "InterchangeCacheWait" module configuration directive
+ */
+static const char *ic_cachewait_cmd(cmd_parms *parms,void *mconfig,const char *arg)
+{
+	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+
+	conf_rec->cache_wait = atoi(arg);
+	if (conf_rec->cache_wait <= 0)
+		return "InterchangeCacheWait must be positive";
+	return NULL;
+}
+
+/*
+ *	ic_stats_cmd()
+ *	--------------
+ *	Handle the "InterchangeStats" module configuration directive
+ */
+static const char *ic_stats_cmd(cmd_parms *parms,void *mconfig,const char *file)
+{
+	ic_conf_rec *conf_rec = (ic_conf_rec *)mconfig;
+
+	conf_rec->stats_file = ap_server_root_relative(parms->pool,file);
+	return NULL;
+}
+
 /*
  *	ic_droprequestlist_cmd()
  *	------------------------
@@ -385,102 +1250,534 @@ static const char *ic_interchangescript_cmd(cmd_parms *parms,void *mconfig,const
 }
 
 /*
- *	ic_connect()
- *	------------
- *	Connect to the Interchange server
+ *	ic_log_reason()
+ *	---------------
+ *	Log an error against the requested URI
  */
-static BUFF *ic_connect(request_rec *r,ic_conf_rec *conf_rec)
+static void ic_log_reason(const char *reason,request_rec *r)
 {
-	BUFF *ic_buff;
-	ic_socket_rec *sock_rec;
-	int ic_sock,retry,srv;
-	int connected = 0;
+	ap_log_rerror(APLOG_MARK,APLOG_ERR,0,r,"mod_interchange: %s: %s",reason,r->uri);
+}
+
+/*
+ *	ic_breaker()
+ *	------------
+ *	Find the circuit breaker for a server, the first time it is
+ *	needed in this child
+ */
+static link_breaker *ic_breaker(ic_conf_rec *conf_rec,ic_socket_rec *sock_rec)
+{
+	link_breaker *breaker;
+
+#if APR_HAS_THREADS
+	if (ic_mutex)
+		apr_thread_mutex_lock(ic_mutex);
+#endif
+	if (!sock_rec->breaker_opened){
+		sock_rec->breaker = link_breaker_open(conf_rec->breaker_file,sock_rec->address,conf_rec->breaker_failures,conf_rec->breaker_cooldown);
+		sock_rec->breaker_opened = 1;
+	}
+	breaker = sock_rec->breaker;
+#if APR_HAS_THREADS
+	if (ic_mutex)
+		apr_thread_mutex_unlock(ic_mutex);
+#endif
+	return breaker;
+}
+
+/*
+ *	ic_timings()
+ *	------------
+ *	Find the request timings for a server, the first time they are
+ *	needed in this child
+ */
+static link_stats *ic_timings(ic_conf_rec *conf_rec,ic_socket_rec *sock_rec)
+{
+	link_stats *stats;
+
+#if APR_HAS_THREADS
+	if (ic_mutex)
+		apr_thread_mutex_lock(ic_mutex);
+#endif
+	if (!sock_rec->timings_opened){
+		sock_rec->timings = link_stats_open(conf_rec->stats_file,sock_rec->address);
+		sock_rec->timings_opened = 1;
+	}
+	stats = sock_rec->timings;
+#if APR_HAS_THREADS
+	if (ic_mutex)
+		apr_thread_mutex_unlock(ic_mutex);
+#endif
+	return stats;
+}
+
+/*
+ *	ic_timing_begin()
+ *	-----------------
+ *	Start timing a request that began at "start" and has just been
+ *	connected to a server, if the server's timings are kept.
+ *	The timing is recorded when the request ends, if not before
+ */
+static ic_timing_rec *ic_timing_begin(request_rec *r,ic_conf_rec *conf_rec,ic_socket_rec *sock_rec,long long start)
+{
+	ic_timing_rec *timing;
+	link_stats *stats;
+	int i;
+
+	if (!conf_rec->stats_file || !(stats = ic_timings(conf_rec,sock_rec)))
+		return NULL;
+
+	timing = (ic_timing_rec *)apr_palloc(r->pool,sizeof(ic_timing_rec));
+	timing->stats = stats;
+	timing->start = timing->phase_start = start;
+	for (i = 0; i < LINK_PHASES; i++)
+		timing->phase_us[i] = -1;
+	timing->status = 0;
+	ic_timing_phase(timing,LINK_PHASE_CONNECT);
+
+	link_stats_begin(stats);
+	apr_pool_cleanup_register(r->pool,timing,ic_timing_end,apr_pool_cleanup_null);
+	return timing;
+}
+
+/*
+ *	ic_timing_phase()
+ *	-----------------
+ *	Note the end of a phase of the request, the first time it ends
+ */
+static void ic_timing_phase(ic_timing_rec *timing,int phase)
+{
+	long long now;
+
+	if (!timing || timing->phase_us[phase] >= 0)
+		return;
+	now = link_now_us();
+	timing->phase_us[phase] = now - timing->phase_start;
+	timing->phase_start = now;
+}
+
+/*
+ *	ic_timing_end()
+ *	---------------
+ *	Record the timing of a request, a pool cleanup
+ */
+static apr_status_t ic_timing_end(void *data)
+{
+	ic_timing_rec *timing = (ic_timing_rec *)data;
+
+	timing->phase_us[LINK_PHASE_TOTAL] = link_now_us() - timing->start;
+	link_stats_end(timing->stats,timing->status,timing->phase_us);
+	return APR_SUCCESS;
+}
+
+/*
+ *	ic_finished()
+ *	-------------
+ *	The response has been read from the server, so the request
+ *	no longer counts against it, and its timing is over
+ */
+static void ic_finished(request_rec *r,ic_socket_rec *sock_rec,ic_timing_rec *timing)
+{
+	if (sock_rec)
+		apr_pool_cleanup_run(r->pool,sock_rec,ic_release);
+	if (timing){
+		ic_timing_phase(timing,LINK_PHASE_DRAIN);
+		apr_pool_cleanup_run(r->pool,timing,ic_timing_end);
+	}
+}
+
+/*
+ *	ic_cache()
+ *	----------
+ *	Open the page cache, the first time it is needed in this child
+ */
+static link_cache *ic_cache(ic_conf_rec *conf_rec)
+{
+	link_cache *cache;
+
+#if APR_HAS_THREADS
+	if (ic_mutex)
+		apr_thread_mutex_lock(ic_mutex);
+#endif
+	if (!conf_rec->cache_opened){
+		conf_rec->cache = link_cache_open(conf_rec->cache_file,conf_rec->cache_size);
+		conf_rec->cache_opened = 1;
+	}
+	cache = conf_rec->cache;
+#if APR_HAS_THREADS
+	if (ic_mutex)
+		apr_thread_mutex_unlock(ic_mutex);
+#endif
+	return cache;
+}
+
+/*
+ *	ic_reserve()
+ *	------------
+ *	Count a request against a server, unless it already has as many
+ *	as it is allowed
+ */
+static int ic_reserve(ic_socket_rec *sock_rec)
+{
+	apr_uint32_t *active,n;
+
+	if (sock_rec->slot < 0)
+		return 1;
+	active = &ic_stats[sock_rec->slot].active;
+	if (!sock_rec->max_active){
+		apr_atomic_inc32(active);
+	}else{
+		do{
+			n = apr_atomic_read32(active);
+			if (n >= sock_rec->max_active)
+				return 0;
+		}while (apr_atomic_cas32(active,n + 1,n) != n);
+	}
+	if (ic_held)
+		apr_atomic_inc32(&ic_held[sock_rec->slot]);
+	return 1;
+}
+
+/*
+ *	ic_release()
+ *	------------
+ *	Stop counting a request against a server, also used
+ *	as a pool cleanup
+ */
+static apr_status_t ic_release(void *data)
+{
+	ic_socket_rec *sock_rec = (ic_socket_rec *)data;
+
+	if (sock_rec->slot < 0)
+		return APR_SUCCESS;
+	if (ic_held)
+		apr_atomic_dec32(&ic_held[sock_rec->slot]);
+	apr_atomic_dec32(&ic_stats[sock_rec->slot].active);
+	return APR_SUCCESS;
+}
+
+/*
+ *	ic_choose()
+ *	-----------
+ *	Pick the server with the fewest requests in hand for its weight,
+ *	from those not marked in skip and not left out by the health
+ *	probes, and count the request against it.  Backup servers are
+ *	only used when no primary server is available.  If none is free
+ *	but some are only at their limit, busy is set and -1 returned.
+ */
+static int ic_choose(ic_conf_rec *conf_rec,const char *skip,int *busy)
+{
+	ic_socket_rec **servers = (ic_socket_rec **)conf_rec->servers->elts;
+	ic_socket_rec *sock_rec;
+	apr_uint32_t active,best_active = 0;
+	int n = conf_rec->servers->nelts;
+	int backup,best,i,j,start;
+
+	/*
+	 *	start each search at a different server, so that those
+	 *	with equal loads take turns
+	 */
+	start = n > 1 ? apr_atomic_inc32(ic_rotor) % n : 0;
+	*busy = 0;
+	for (backup = 0; backup < 2; backup++){
+again:
+		best = -1;
+		for (j = 0; j < n; j++){
+			i = (start + j) % n;
+			sock_rec = servers[i];
+			if (sock_rec->backup != backup || skip[i])
+				continue;
+			if (sock_rec->slot < 0){
+				active = 0;
+			}else{
+				if (apr_atomic_read32(&ic_stats[sock_rec->slot].down))
+					continue;
+				active = apr_atomic_read32(&ic_stats[sock_rec->slot].active);
+			}
+			if (sock_rec->max_active && active >= sock_rec->max_active){
+				*busy = 1;
+				continue;
+			}
+			if (best < 0 || (apr_uint64_t)(active + 1) * servers[best]->weight < (apr_uint64_t)(best_active + 1) * sock_rec->weight){
+				best = i;
+				best_active = active;
+			}
+		}
+		if (best >= 0){
+			/*
+			 *	another request may have taken the last place
+			 *	since we looked
+			 */
+			if (!ic_reserve(servers[best]))
+				goto again;
+			return best;
+		}
+
+		/*
+		 *	wait for a busy primary server rather than
+		 *	turning to the backups
+		 */
+		if (*busy)
+			break;
+	}
+	return -1;
+}
+
+/*
+ *	ic_queue_wait()
+ *	---------------
+ *	Wait a little for a busy server, joining the location's queue on
+ *	the first call.  Returns zero if the queue is full or the request
+ *	has waited for too long.
+ */
+static int ic_queue_wait(request_rec *r,ic_conf_rec *conf_rec,int *queued,long long *deadline,int waits)
+{
+	apr_uint32_t *waiting,n;
+	long long now = link_now_ms();
+	int pause;
+
+	if (!*queued){
+		if (conf_rec->queue_slot < 0){
+			ic_log_reason("Every Interchange server is at its request limit",r);
+			return 0;
+		}
+		waiting = &ic_waiting[conf_rec->queue_slot];
+		do{
+			n = apr_atomic_read32(waiting);
+			if (n >= conf_rec->queue_size){
+				ic_log_reason("Every Interchange server is at its request limit and the queue is full",r);
+				return 0;
+			}
+		}while (apr_atomic_cas32(waiting,n + 1,n) != n);
+		if (ic_held)
+			apr_atomic_inc32(&ic_held[ic_nservers + conf_rec->queue_slot]);
+		*queued = 1;
+		*deadline = now + conf_rec->queue_timeout;
+	}else if (now >= *deadline){
+		ic_log_reason("Timed out waiting for an Interchange server",r);
+		return 0;
+	}
+
+	/*
+	 *	the servers' counts are shared by processes that can't signal
+	 *	each other, so look again after a short pause
+	 */
+	pause = link_backoff_ms(waits,IC_QUEUE_POLL);
+	if (pause > *deadline - now)
+		pause = (int)(*deadline - now);
+	link_pause_ms(pause);
+	return 1;
+}
+
+/*
+ *	ic_close_socket()
+ *	-----------------
+ *	Pool cleanup to close the Interchange socket
+ */
+static apr_status_t ic_close_socket(void *sock)
+{
+	return apr_socket_close((apr_socket_t *)sock);
+}
+
+/*
+ *	ic_connect()
+ *	------------
+ *	Choose an Interchange server and connect to it, noting which
+ *	server was used
+ */
+static apr_socket_t *ic_connect(request_rec *r,ic_conf_rec *conf_rec,ic_socket_rec **used)
+{
+	ic_socket_rec **servers = (ic_socket_rec **)conf_rec->servers->elts;
+	apr_socket_t *ic_sock = NULL;
+	ic_socket_rec *sock_rec = NULL;
+	link_breaker *breaker;
+	long long deadline = 0;
+	char *skip,*trying;
+	int fd = -1,retry,srv,tried = 0,busy,allowed;
+	int connected = 0,queued = 0,waits = 0,failed = 0;
+
+	skip = (char *)apr_palloc(r->pool,conf_rec->servers->nelts);
+	trying = (char *)apr_pcalloc(r->pool,conf_rec->servers->nelts);
 
 	/*
 	 *	connect the new socket to the Interchange server
 	 *
-	 *	if the connection to the Interchange server fails then
-	 *	retry IC_DEFAULT_CONNECT_TRIES times, sleeping for
-	 *	IC_DEFAULT_CONNECT_RETRY_DELAY seconds between each retry
+	 *	each round tries every available server once, best first;
+	 *	if they all fail then retry up to connect_tries times,
+	 *	waiting a few milliseconds before the first retry and
+	 *	doubling that, with jitter, up to connect_retry_delay seconds
+	 *
+	 *	a server whose circuit breaker is open is skipped, and if
+	 *	every server is skipped we give up at once instead of
+	 *	waiting to find out that it is still down.  Each refusal
+	 *	counts against the server's breaker as it happens, and
+	 *	one that was only busy not at all; but a server we were
+	 *	let through to is retried even if its breaker opens
+	 *	meanwhile, so that the first of us to connect closes it
+	 *
+	 *	if the servers are only at their request limits then we
+	 *	wait in the queue for one of them to finish a request
 	 */
-	for (retry = 0; retry != conf_rec->connect_tries; retry++){
-		for (srv = 0; srv != IC_MAX_SERVERS; srv++){
-			if ((sock_rec = conf_rec->server[srv]) == NULL)
+	for (retry = 0; retry != conf_rec->connect_tries && !failed; retry++){
+		tried = 0;
+		memset(skip,0,conf_rec->servers->nelts);
+		for (;;){
+			if ((srv = ic_choose(conf_rec,skip,&busy)) < 0){
+				if (busy && ic_queue_wait(r,conf_rec,&queued,&deadline,waits++))
+					continue;
+				failed = busy;
 				break;
-			if (srv){
-				ap_log_rerror(APLOG_MARK,APLOG_ERR|APLOG_NOERRNO,r,"Attempting to connect to backup server %d",srv);
+			}
+			sock_rec = servers[srv];
+			skip[srv] = 1;
+			breaker = ic_breaker(conf_rec,sock_rec);
+			allowed = trying[srv] ? 1 : link_breaker_allow(breaker);
+			if (!allowed){
+				ic_release(sock_rec);
+				continue;
+			}
+			tried++;
+			if (sock_rec->backup){
+				ap_log_rerror(APLOG_MARK,APLOG_ERR,0,r,"Attempting to connect to backup server %s",sock_rec->address);
 			}
 
 			/*
 			 *	attempt to connect to the Interchange server
 			 */
-			ic_sock = ap_psocket(r->pool,sock_rec->family,SOCK_STREAM,0);
-			if (ic_sock < 0){
-				ap_log_reason("socket",r->uri,r);
-				return NULL;
+			fd = socket(sock_rec->family,SOCK_STREAM,0);
+			if (fd < 0){
+				ic_release(sock_rec);
+				ic_log_reason("socket",r);
+				failed = 1;
+				break;
 			}
-			ap_hard_timeout("ic_connect",r);
-			if (connect(ic_sock,sock_rec->sockaddr,sock_rec->size) >= 0){
+			if (link_connect(fd,sock_rec->sockaddr,sock_rec->size,conf_rec->connect_timeout) >= 0){
+				link_breaker_success(breaker);
 				connected++;
 				break;
 			}
-			ap_kill_timeout(r);
-			ap_pclosesocket(r->pool,ic_sock);
+			if (!link_connect_busy(errno))
+				link_breaker_failure(breaker);
+
+			/*
+			 *	the breaker's trial is not retried, as its
+			 *	answer decides whether the breaker reopens
+			 */
+			trying[srv] = allowed != LINK_BREAKER_TRIAL;
+			if (conf_rec->stats_file)
+				link_stats_connect_failed(ic_timings(conf_rec,sock_rec));
+			close(fd);
+			ic_release(sock_rec);
 		}
-		if (connected)
+		if (connected || failed || !tried)
 			break;
-		sleep(conf_rec->connect_retry_delay);
+		if (retry + 1 != conf_rec->connect_tries)
+			link_pause_ms(link_backoff_ms(retry,conf_rec->connect_retry_delay * 1000));
 	}
-	ap_kill_timeout(r);
-	if (retry == conf_rec->connect_tries){
-		ap_log_reason("Connection failed",r->uri,r);
+	if (queued){
+		if (ic_held)
+			apr_atomic_dec32(&ic_held[ic_nservers + conf_rec->queue_slot]);
+		apr_atomic_dec32(&ic_waiting[conf_rec->queue_slot]);
+	}
+	if (!connected){
+		if (sock_rec && conf_rec->stats_file)
+			link_stats_turned_away(ic_timings(conf_rec,sock_rec));
+		if (!failed)
+			ic_log_reason(tried ? "Connection failed" : "No Interchange server is up, by its health probe or circuit breaker",r);
 		return NULL;
 	}
 
 	/*
-	 *	create an Apache BUFF structure for our new connection
+	 *	the request counts against the server until the response
+	 *	has been passed on, or failing that until the request ends
 	 */
-	ic_buff = ap_bcreate(r->pool,B_RDWR|B_SOCKET);
-	if (!ic_buff){
-		ap_log_reason("failed to create BUFF",r->uri,r);
+	apr_pool_cleanup_register(r->pool,sock_rec,ic_release,apr_pool_cleanup_null);
+	*used = sock_rec;
+
+	/*
+	 *	wrap the connection up as an APR socket, to be closed with
+	 *	the request, and apply the server's I/O timeout to it
+	 */
+	if (apr_os_sock_put(&ic_sock,&fd,r->pool) != APR_SUCCESS){
+		close(fd);
+		ic_log_reason("failed to create the Interchange socket",r);
 		return NULL;
 	}
-	ap_bpushfd(ic_buff,ic_sock,ic_sock);
-	return ic_buff;
+	apr_pool_cleanup_register(r->pool,ic_sock,ic_close_socket,apr_pool_cleanup_null);
+	apr_socket_timeout_set(ic_sock,r->server->timeout);
+	return ic_sock;
 }
 
 /*
- *	ic_select()
- *	-----------
- *	Convenient wrapper for select().
- *	Wait for data to become available on the socket, or
- *	for an error to occur, and return the appropriate status
- *	code to the calling function.
+ *	ic_send_brigade()
+ *	-----------------
+ *	Send the data in a brigade to the Interchange server and empty it,
+ *	noting whether the end of the stream was reached
  */
-static int ic_select(int sock_rd,int sock_wr,int secs,int usecs)
+static apr_status_t ic_send_brigade(apr_socket_t *ic_sock,apr_bucket_brigade *bb,int *eos)
 {
-	fd_set sock_set_rd,sock_set_wr;
-	fd_set *rd = NULL,*wr = NULL;
-	struct timeval tv;
-	int rc;
+	apr_bucket *b;
+	apr_status_t rv = APR_SUCCESS;
+
+	for (b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb); b = APR_BUCKET_NEXT(b)){
+		const char *data;
+		apr_size_t len,sent;
 
-	do{
-		if (sock_rd > 0){
-			FD_ZERO(&sock_set_rd);
-			FD_SET(sock_rd,&sock_set_rd);
-			rd = &sock_set_rd;
+		if (APR_BUCKET_IS_EOS(b)){
+			if (eos)
+				*eos = 1;
+			break;
 		}
-		if (sock_wr > 0){
-			FD_ZERO(&sock_set_wr);
-			FD_SET(sock_wr,&sock_set_wr);
-			wr = &sock_set_wr;
+		if (APR_BUCKET_IS_METADATA(b))
+			continue;
+		if ((rv = apr_bucket_read(b,&data,&len,APR_BLOCK_READ)) != APR_SUCCESS)
+			break;
+		while (len){
+			sent = len;
+			if ((rv = apr_socket_send(ic_sock,data,&sent)) != APR_SUCCESS)
+				break;
+			data += sent;
+			len -= sent;
 		}
+		if (rv != APR_SUCCESS)
+			break;
+	}
+	apr_brigade_cleanup(bb);
+	return rv;
+}
 
-		tv.tv_sec = secs;
-		tv.tv_usec = usecs;
-		rc = ap_select(((sock_rd > sock_wr) ? sock_rd : sock_wr) + 1,rd,wr,NULL,&tv);
-	}while (rc == 0);
-	return rc;
+/*
+ *	ic_put_frame()
+ *	--------------
+ *	Add the header of a binary link protocol frame to a brigade
+ */
+static void ic_put_frame(apr_bucket_brigade *bb,int type,apr_uint32_t len)
+{
+	char hdr[5];
+
+	hdr[0] = type;
+	hdr[1] = (len >> 24) & 0xff;
+	hdr[2] = (len >> 16) & 0xff;
+	hdr[3] = (len >> 8) & 0xff;
+	hdr[4] = len & 0xff;
+	apr_brigade_write(bb,NULL,NULL,hdr,5);
+}
+
+/*
+ *	ic_put_string()
+ *	---------------
+ *	Add a length-prefixed string within a binary frame to a brigade
+ */
+static void ic_put_string(apr_bucket_brigade *bb,const char *str,apr_uint32_t len)
+{
+	char hdr[4];
+
+	hdr[0] = (len >> 24) & 0xff;
+	hdr[1] = (len >> 16) & 0xff;
+	hdr[2] = (len >> 8) & 0xff;
+	hdr[3] = len & 0xff;
+	apr_brigade_write(bb,NULL,NULL,hdr,4);
+	apr_brigade_write(bb,NULL,NULL,str,len);
 }
 
 /*
@@ -488,48 +1785,24 @@ static int ic_select(int sock_rd,int sock_wr,int secs,int usecs)
  *	-----------------
  *	Send the client's page/form request to the Interchange server
  */
-static int ic_send_request(request_rec *r,ic_conf_rec *conf_rec,BUFF *ic_buff)
+static int ic_send_request(request_rec *r,ic_conf_rec *conf_rec,apr_socket_t *ic_sock)
 {
+	apr_array_header_t *env_arr;
+	apr_bucket_brigade *bb;
+	apr_status_t rv;
 	char **env,**e,*rp;
-	int env_count,rc;
+	int i;
+	apr_uint32_t env_len;
 	char request_uri[MAX_STRING_LEN];
 	char redirect_url[MAX_STRING_LEN];
 
-	/*
-	 *	send the Interchange-link arg parameter
-	 *	(this is always empty for a CGI request)
-	 */
-	ap_hard_timeout("ic_send_request",r);
-	if (ap_bputs("arg 0\n",ic_buff) < 0){
-		ap_log_reason("error writing to Interchange",r->uri,r);
-		return HTTP_INTERNAL_SERVER_ERROR;
-	}
-	ap_reset_timeout(r);
-
 	/*
 	 *	initialize the environment to send to Interchange
 	 */
 	ap_add_common_vars(r);
 	ap_add_cgi_vars(r);
 	env = ap_create_environment(r->pool,r->subprocess_env);
-
-	/*
-	 *	count the number of environment variables present
-	 */
-	for (e = env,env_count = 0; *e != NULL; e++,env_count++){
-		if (strncmp(*e,"PATH_INFO=",10) == 0)
-			env_count--;
-	}
-	env_count++;
-
-	/*
-	 *	send the environment variable count to Interchange
-	 */
-	if (ap_bprintf(ic_buff,"env %d\n",env_count) < 0){
-		ap_log_reason("error writing to Interchange",r->uri,r);
-		return HTTP_INTERNAL_SERVER_ERROR;
-	}
-	ap_reset_timeout(r);
+	env_arr = apr_array_make(r->pool,64,sizeof(char *));
 
 	/*
 	 *	ignore the PATH_INFO variable and fix the SCRIPT_NAME,
@@ -538,34 +1811,24 @@ static int ic_send_request(request_rec *r,ic_conf_rec *conf_rec,BUFF *ic_buff)
 	request_uri[0] = '\0';
 	redirect_url[0] = '\0';
 	for (e = env; *e != NULL; e++){
-		int len;
-		char tmp[MAX_STRING_LEN];
 		char *p = *e;
 
 		if (strncmp(p,"PATH_INFO=",10) == 0)
 			continue;
 		if (strncmp(p,"REDIRECT_URL=",13) == 0){
-			strncpy(redirect_url,p + 13,MAX_STRING_LEN - 14);
+			apr_cpystrn(redirect_url,p + 13,MAX_STRING_LEN);
 			continue;
 		}
 		if (strncmp(p,"REQUEST_URI=",12) == 0)
-			strncpy(request_uri,p + 12,MAX_STRING_LEN - 13);
+			apr_cpystrn(request_uri,p + 12,MAX_STRING_LEN);
 		else if (strncmp(p,"SCRIPT_NAME=",12) == 0){
-			p = tmp;
-			strcpy(p,"SCRIPT_NAME=");
-
 			if (conf_rec->script_name[0])
-				strcat(p,conf_rec->script_name);
-			else{
-				strcat(p,"/");
-				strcat(p,conf_rec->location);
-			}
-		}
-		len = strlen(p);
-		if (len && ap_bprintf(ic_buff,"%d %s\n",len,p) < 0){
-			ap_log_reason("error writing to Interchange",r->uri,r);
-			return HTTP_INTERNAL_SERVER_ERROR;
+				p = apr_pstrcat(r->pool,"SCRIPT_NAME=",conf_rec->script_name,NULL);
+			else
+				p = apr_pstrcat(r->pool,"SCRIPT_NAME=/",conf_rec->location,NULL);
 		}
+		if (*p)
+			*(char **)apr_array_push(env_arr) = p;
 	}
 
 	rp = request_uri;
@@ -585,8 +1848,7 @@ static int ic_send_request(request_rec *r,ic_conf_rec *conf_rec,BUFF *ic_buff)
 			rp--;
 	}
 
-	strncpy(request_uri,rp,MAX_STRING_LEN - 1);
-	request_uri[MAX_STRING_LEN - 1] = '\0';
+	memmove(request_uri,rp,strlen(rp) + 1);
 
 	for (rp = request_uri; *rp != '\0'; rp++){
 		if (*rp == '?'){
@@ -595,19 +1857,16 @@ static int ic_send_request(request_rec *r,ic_conf_rec *conf_rec,BUFF *ic_buff)
 		}
 	}
 	switch (ap_unescape_url(request_uri)){
-	case BAD_REQUEST:
-	case NOT_FOUND:
-		ap_log_reason("Bad URI entities found",r->uri,r);
+	case HTTP_BAD_REQUEST:
+	case HTTP_NOT_FOUND:
+		ic_log_reason("Bad URI entities found",r);
 		return HTTP_INTERNAL_SERVER_ERROR;
 	}
 
 	/*
 	 *	send the PATH_INFO variable as our "fixed" REQUEST_URI
 	 */
-	if (ap_bprintf(ic_buff,"%d PATH_INFO=%s\n",strlen(request_uri) + 10,request_uri) < 0){
-		ap_log_reason("error writing to Interchange",r->uri,r);
-		return HTTP_INTERNAL_SERVER_ERROR;
-	}
+	*(char **)apr_array_push(env_arr) = apr_pstrcat(r->pool,"PATH_INFO=",request_uri,NULL);
 
 	/*
 	 *	check if we have a REDIRECT_URL
@@ -631,8 +1890,7 @@ static int ic_send_request(request_rec *r,ic_conf_rec *conf_rec,BUFF *ic_buff)
 				rp--;
 		}
 
-		strncpy(redirect_url,rp,MAX_STRING_LEN - 1);
-		redirect_url[MAX_STRING_LEN - 1] = '\0';
+		memmove(redirect_url,rp,strlen(rp) + 1);
 
 		for (rp = redirect_url; *rp != '\0'; rp++){
 			if (*rp == '?'){
@@ -641,183 +1899,493 @@ static int ic_send_request(request_rec *r,ic_conf_rec *conf_rec,BUFF *ic_buff)
 			}
 		}
 		switch (ap_unescape_url(redirect_url)){
-		case BAD_REQUEST:
-		case NOT_FOUND:
-			ap_log_reason("Bad URI entities found",r->uri,r);
+		case HTTP_BAD_REQUEST:
+		case HTTP_NOT_FOUND:
+			ic_log_reason("Bad URI entities found",r);
 			return HTTP_INTERNAL_SERVER_ERROR;
 		}
 
-		if (ap_bprintf(ic_buff,"%d REDIRECT_URL=%s\n",strlen(redirect_url) + 13,redirect_url) < 0){
-			ap_log_reason("error writing to Interchange",r->uri,r);
-			return HTTP_INTERNAL_SERVER_ERROR;
-		}
+		*(char **)apr_array_push(env_arr) = apr_pstrcat(r->pool,"REDIRECT_URL=",redirect_url,NULL);
 	}
-	ap_reset_timeout(r);
+	env = (char **)env_arr->elts;
 
 	/*
-	 *	send the request body, if any
+	 *	queue up the Interchange-link arg parameter
+	 *	(this is always empty for a CGI request),
+	 *	the environment and the start of the request body
 	 */
-	if (ap_should_client_block(r)){
-		char buffer[MAX_STRING_LEN];
-		int len_read;
-		long length = r->remaining;
-
-		if (ap_bprintf(ic_buff,"entity\n%ld ",length) < 0){
-			ap_log_reason("error writing to Interchange",r->uri,r);
-			return HTTP_INTERNAL_SERVER_ERROR;
-		}
-
+	if (conf_rec->protocol == 2 && ap_should_client_block(r) && r->remaining > (apr_off_t)0xffffffffUL){
+		ic_log_reason("request body too large for the binary link protocol",r);
+		return HTTP_REQUEST_ENTITY_TOO_LARGE;
+	}
+	bb = apr_brigade_create(r->pool,r->connection->bucket_alloc);
+	if (conf_rec->protocol == 2){
 		/*
-		 *	read a block of data from the client and send
-		 *	it to the Interchange server, until there
-		 *	is nothing more to read from the client
+		 *	the whole environment goes in one frame, each
+		 *	variable split into a length-prefixed name and value
 		 */
-		while ((len_read = ap_get_client_block(r,buffer,sizeof(buffer))) > 0){
-			ap_reset_timeout(r);
-
-			if (ap_bwrite(ic_buff,buffer,len_read) != len_read){
-				ap_log_reason("error writing client block to Interchange",r->uri,r);
-				return HTTP_INTERNAL_SERVER_ERROR;
-			}
-			ap_reset_timeout(r);
+		env_len = 0;
+		for (i = 0; i < env_arr->nelts; i++){
+			if (strchr(env[i],'='))
+				env_len += 8 + strlen(env[i]) - 1;
 		}
-		if (len_read < 0){
-			ap_log_reason("error reading block from client",r->uri,r);
-			return HTTP_INTERNAL_SERVER_ERROR;
+		apr_brigade_write(bb,NULL,NULL,IC_FRAME_PREAMBLE,IC_FRAME_PREAMBLE_LEN);
+		ic_put_frame(bb,IC_FRAME_ARGS,0);
+		ic_put_frame(bb,IC_FRAME_ENV,env_len);
+		for (i = 0; i < env_arr->nelts; i++){
+			char *value = strchr(env[i],'=');
+
+			if (!value)
+				continue;
+			ic_put_string(bb,env[i],value - env[i]);
+			ic_put_string(bb,value + 1,strlen(value + 1));
 		}
+		if (ap_should_client_block(r))
+			ic_put_frame(bb,IC_FRAME_ENTITY,r->remaining);
+	}else{
+		apr_brigade_printf(bb,NULL,NULL,"arg 0\nenv %d\n",env_arr->nelts);
+		for (i = 0; i < env_arr->nelts; i++)
+			apr_brigade_printf(bb,NULL,NULL,"%" APR_SIZE_T_FMT " %s\n",strlen(env[i]),env[i]);
+		if (ap_should_client_block(r))
+			apr_brigade_printf(bb,NULL,NULL,"entity\n%" APR_OFF_T_FMT " ",r->remaining);
+	}
+	if ((rv = ic_send_brigade(ic_sock,bb,NULL)) != APR_SUCCESS){
+		ap_log_rerror(APLOG_MARK,APLOG_ERR,rv,r,"mod_interchange: error writing to Interchange: %s",r->uri);
+		return HTTP_BAD_GATEWAY;
+	}
+
+	/*
+	 *	stream the request body, if any, through to Interchange
+	 *	as it arrives from the client
+	 */
+	if (ap_should_client_block(r)){
+		int eos = 0;
+
+		do{
+			rv = ap_get_brigade(r->input_filters,bb,AP_MODE_READBYTES,APR_BLOCK_READ,IC_BODY_READ_SIZE);
+			if (rv != APR_SUCCESS){
+				ap_log_rerror(APLOG_MARK,APLOG_ERR,rv,r,"mod_interchange: error reading request body: %s",r->uri);
+				return ap_map_http_request_error(rv,HTTP_BAD_REQUEST);
+			}
+			if ((rv = ic_send_brigade(ic_sock,bb,&eos)) != APR_SUCCESS){
+				ap_log_rerror(APLOG_MARK,APLOG_ERR,rv,r,"mod_interchange: error writing client block to Interchange: %s",r->uri);
+				return HTTP_BAD_GATEWAY;
+			}
+		}while (!eos);
 
 		/*
 		 *	send an end of line character to Interchange
 		 */
-		if (ap_bputc('\n',ic_buff) < 0){
-			ap_log_reason("error writing to Interchange",r->uri,r);
-			return HTTP_INTERNAL_SERVER_ERROR;
-		}
+		if (conf_rec->protocol != 2)
+			apr_brigade_puts(bb,NULL,NULL,"\n");
 	}
 
 	/*
 	 *	all data has been sent, so send the "end" marker
 	 */
-	ap_reset_timeout(r);
-	if (ap_bputs("end\n",ic_buff) < 0){
-		ap_log_reason("error writing the end marker to Interchange",r->uri,r);
-		return HTTP_INTERNAL_SERVER_ERROR;
+	if (conf_rec->protocol == 2)
+		ic_put_frame(bb,IC_FRAME_END,0);
+	else
+		apr_brigade_puts(bb,NULL,NULL,"end\n");
+	if ((rv = ic_send_brigade(ic_sock,bb,NULL)) != APR_SUCCESS){
+		ap_log_rerror(APLOG_MARK,APLOG_ERR,rv,r,"mod_interchange: error writing the end marker to Interchange: %s",r->uri);
+		return HTTP_BAD_GATEWAY;
 	}
-	if (ap_bflush(ic_buff) < 0){
-		ap_log_reason("error flushing data to Interchange",r->uri,r);
-		return HTTP_INTERNAL_SERVER_ERROR;
+	apr_brigade_destroy(bb);
+	return OK;
+}
+
+/*
+ *	ic_cacheable()
+ *	--------------
+ *	Can the response to this request come from the page cache?
+ *	Only plain GETs by visitors without a session qualify, as any
+ *	other page may be theirs alone
+ */
+static int ic_cacheable(request_rec *r,ic_conf_rec *conf_rec)
+{
+	if (!conf_rec->cache_file)
+		return 0;
+	if (r->method_number != M_GET || r->header_only)
+		return 0;
+	if (apr_table_get(r->headers_in,"Authorization"))
+		return 0;
+	if (apr_table_get(r->headers_in,"Content-Length") || apr_table_get(r->headers_in,"Transfer-Encoding"))
+		return 0;
+	if (link_cache_cookie(apr_table_get(r->headers_in,"Cookie"),conf_rec->cache_cookies))
+		return 0;
+	return 1;
+}
+
+/*
+ *	ic_cache_key()
+ *	--------------
+ *	The page cache key for a request: the server name and port, the
+ *	URI with its query string, then each header the pages vary by,
+ *	one to a line, in the same form as the link programs use
+ */
+static char *ic_cache_key(request_rec *r,ic_conf_rec *conf_rec)
+{
+	ic_cache_header *hdr = (ic_cache_header *)conf_rec->cache_key->elts;
+	const char *value;
+	char *key;
+	int i;
+
+	key = apr_psprintf(r->pool,"%s:%u\n%s\n",ap_get_server_name(r),ap_get_server_port(r),r->unparsed_uri);
+	for (i = 0; i < conf_rec->cache_key->nelts; i++){
+		value = apr_table_get(r->headers_in,hdr[i].header);
+		key = apr_pstrcat(r->pool,key,hdr[i].env,"=",value ? value : "","\n",NULL);
 	}
+	return key;
+}
 
-	ap_kill_timeout(r);
-	return OK;
+/*
+ *	ic_discard_response()
+ *	---------------------
+ *	Soak up the rest of the response from the Interchange server
+ */
+static void ic_discard_response(apr_bucket_brigade *bb)
+{
+	apr_bucket *b;
+	const char *buf;
+	apr_size_t len;
+
+	for (b = APR_BRIGADE_FIRST(bb); b != APR_BRIGADE_SENTINEL(bb); b = APR_BUCKET_NEXT(b)){
+		if (APR_BUCKET_IS_EOS(b))
+			break;
+		if (apr_bucket_read(b,&buf,&len,APR_BLOCK_READ) != APR_SUCCESS)
+			break;
+	}
+	apr_brigade_cleanup(bb);
+}
+
+/*
+ *	ic_fill_copy()
+ *	--------------
+ *	Add a block of the response to the copy for the cache, giving
+ *	up on the copy, so that other requests needn't wait for it, if
+ *	the page grows too big to keep
+ */
+static void ic_fill_copy(ic_cache_fill *fill,const char *data,apr_size_t len)
+{
+	apr_size_t size;
+	char *more;
+
+	if (!fill->buf)
+		return;
+	if (fill->got + len > fill->max_page){
+		ic_fill_end(fill,0);
+		return;
+	}
+	if (fill->got + len > fill->size){
+		size = fill->size;
+		while (size < fill->got + len)
+			size *= 2;
+		if (size > fill->max_page)
+			size = fill->max_page;
+		if ((more = realloc(fill->buf,size)) == NULL){
+			ic_fill_end(fill,0);
+			return;
+		}
+		fill->buf = more;
+		fill->size = size;
+	}
+	memcpy(fill->buf + fill->got,data,len);
+	fill->got += len;
+}
+
+/*
+ *	ic_fill_end()
+ *	-------------
+ *	Store the copy in the page cache, once the whole response has
+ *	been read, if it says it may be kept, or else abandon it
+ */
+static void ic_fill_end(ic_cache_fill *fill,int whole)
+{
+	long fresh,stale;
+
+	if (fill->done)
+		return;
+	fill->done = 1;
+	if (fill->buf && whole && (fresh = link_cache_lifetime(fill->buf,fill->got,&stale)) > 0)
+		link_cache_put(fill->cache,fill->key,fill->keylen,fill->buf,fill->got,fresh,stale >= 0 ? stale : fill->stale);
+	else
+		link_cache_abandon(fill->cache,fill->key,fill->keylen);
+	free(fill->buf);
+	fill->buf = NULL;
+}
+
+/*
+ *	ic_fill_cleanup()
+ *	-----------------
+ *	Pool cleanup to abandon a copy that was never finished
+ */
+static apr_status_t ic_fill_cleanup(void *data)
+{
+	ic_fill_end((ic_cache_fill *)data,0);
+	return APR_SUCCESS;
+}
+
+/*
+ *	a bucket that reads the response from the Interchange socket, as
+ *	the socket bucket does, and copies each block for the cache as
+ *	it is passed on to the client
+ *
+ *	setting it aside or copying it reads the next block, as a filter
+ *	would have to, and sets aside or copies the heap bucket that
+ *	holds it.  It has no length until it is read, and a bucket of
+ *	unknown length is read before anything splits it, so a split
+ *	can't be asked of it
+ */
+static const apr_bucket_type_t ic_fill_bucket_type = {
+	"IC_CACHE_FILL",5,APR_BUCKET_DATA,
+	ic_fill_bucket_destroy,
+	ic_fill_bucket_read,
+	ic_fill_bucket_setaside,
+	apr_bucket_split_notimpl,
+	ic_fill_bucket_copy
+};
+
+/*
+ *	ic_fill_bucket_destroy()
+ *	------------------------
+ *	The rest of the response won't be read, so the copy is no use
+ */
+static void ic_fill_bucket_destroy(void *data)
+{
+	ic_fill_end((ic_cache_fill *)data,0);
+}
+
+/*
+ *	ic_fill_bucket_read()
+ *	---------------------
+ *	Read the next block of the response, turning the bucket into
+ *	a heap bucket holding it, followed by a new fill bucket for
+ *	the rest.  At the end of the response the copy is stored.
+ */
+static apr_status_t ic_fill_bucket_read(apr_bucket *b,const char **str,apr_size_t *len,apr_read_type_e block)
+{
+	ic_cache_fill *fill = (ic_cache_fill *)b->data;
+	apr_interval_time_t timeout = 0;
+	apr_status_t rv;
+	char *buf;
+
+	if (block == APR_NONBLOCK_READ){
+		apr_socket_timeout_get(fill->sock,&timeout);
+		apr_socket_timeout_set(fill->sock,0);
+	}
+	*str = NULL;
+	*len = APR_BUCKET_BUFF_SIZE;
+	buf = apr_bucket_alloc(*len,b->list);
+	rv = apr_socket_recv(fill->sock,buf,len);
+	if (block == APR_NONBLOCK_READ)
+		apr_socket_timeout_set(fill->sock,timeout);
+
+	if (rv != APR_SUCCESS && rv != APR_EOF){
+		apr_bucket_free(buf);
+		return rv;
+	}
+	if (*len > 0){
+		ic_fill_copy(fill,buf,*len);
+		b = apr_bucket_heap_make(b,buf,*len,apr_bucket_free);
+		*str = buf;
+		APR_BUCKET_INSERT_AFTER(b,ic_fill_bucket_create(fill,b->list));
+	}else{
+		apr_bucket_free(buf);
+		b = apr_bucket_immortal_make(b,"",0);
+		*str = (const char *)b->data;
+		ic_fill_end(fill,1);
+	}
+	return APR_SUCCESS;
+}
+
+/*
+ *	ic_fill_bucket_setaside()
+ *	-------------------------
+ *	Read the next block, so that the bucket becomes a heap bucket,
+ *	which needs nothing from the request's pool, and set that aside.
+ *	The fill bucket for the rest that follows it is set aside in its
+ *	turn by whoever is setting aside the brigade
+ */
+static apr_status_t ic_fill_bucket_setaside(apr_bucket *b,apr_pool_t *pool)
+{
+	const char *str;
+	apr_size_t len;
+	apr_status_t rv;
+
+	if ((rv = ic_fill_bucket_read(b,&str,&len,APR_BLOCK_READ)) != APR_SUCCESS)
+		return rv;
+	return apr_bucket_setaside(b,pool);
+}
+
+/*
+ *	ic_fill_bucket_copy()
+ *	---------------------
+ *	Read the next block, as for setting aside, and copy the heap
+ *	bucket it is in
+ */
+static apr_status_t ic_fill_bucket_copy(apr_bucket *b,apr_bucket **c)
+{
+	const char *str;
+	apr_size_t len;
+	apr_status_t rv;
+
+	if ((rv = ic_fill_bucket_read(b,&str,&len,APR_BLOCK_READ)) != APR_SUCCESS)
+		return rv;
+	return apr_bucket_copy(b,c);
+}
+
+/*
+ *	ic_fill_bucket_create()
+ *	-----------------------
+ *	Make a bucket for the rest of a response being copied
+ */
+static apr_bucket *ic_fill_bucket_create(ic_cache_fill *fill,apr_bucket_alloc_t *list)
+{
+	apr_bucket *b = (apr_bucket *)apr_bucket_alloc(sizeof(*b),list);
+
+	APR_BUCKET_INIT(b);
+	b->free = apr_bucket_free;
+	b->list = list;
+	b->type = &ic_fill_bucket_type;
+	b->length = (apr_size_t)(-1);
+	b->start = -1;
+	b->data = fill;
+	return b;
+}
+
+/*
+ *	ic_fill_cache()
+ *	---------------
+ *	Set up the response to be passed on to the client as it is read
+ *	from the Interchange server, with a copy kept to store in the
+ *	page cache if it says it may be kept.  A response that grows too
+ *	big for the cache stops being copied, and is passed on as usual
+ */
+static apr_bucket_brigade *ic_fill_cache(request_rec *r,ic_conf_rec *conf_rec,apr_socket_t *ic_sock,ic_cache_fill *fill)
+{
+	conn_rec *c = r->connection;
+	apr_bucket_brigade *bb;
+	ic_cache_fill *copy;
+
+	copy = (ic_cache_fill *)apr_palloc(r->pool,sizeof(ic_cache_fill));
+	*copy = *fill;
+	copy->sock = ic_sock;
+	copy->size = IC_CACHE_READ_SIZE;
+	copy->got = 0;
+	copy->max_page = conf_rec->cache_max_page;
+	copy->stale = conf_rec->cache_stale;
+	copy->done = 0;
+	copy->buf = malloc(copy->size);
+	if (!copy->buf)
+		ic_fill_end(copy,0);
+	apr_pool_cleanup_register(r->pool,copy,ic_fill_cleanup,apr_pool_cleanup_null);
+
+	bb = apr_brigade_create(r->pool,c->bucket_alloc);
+	APR_BRIGADE_INSERT_TAIL(bb,ic_fill_bucket_create(copy,c->bucket_alloc));
+	APR_BRIGADE_INSERT_TAIL(bb,apr_bucket_eos_create(c->bucket_alloc));
+	return bb;
 }
 
 /*
  *	ic_transfer_response()
  *	----------------------
  *	Read the response from the Interchange server
- *	and relay it to the client
+ *	and relay it to the client, storing it in the page cache
+ *	if this request is to fill it
  */
-static int ic_transfer_response(request_rec *r,BUFF *ic_buff)
+static int ic_transfer_response(request_rec *r,ic_conf_rec *conf_rec,apr_socket_t *ic_sock,ic_socket_rec *sock_rec,ic_cache_fill *fill,ic_timing_rec *timing)
 {
-	const char *location;
-	int rc,ic_sock;
-	char sbuf[MAX_STRING_LEN],argsbuffer[MAX_STRING_LEN];
+	conn_rec *c = r->connection;
+	apr_bucket_brigade *bb;
+
+	if (fill)
+		return ic_relay_response(r,ic_fill_cache(r,conf_rec,ic_sock,fill),sock_rec,timing);
 
 	/*
-	 *	get the socket we are using to talk to the
-	 *	Interchange server, and wait for Interchange to
-	 *	send us some data
+	 *	the response is read from the Interchange socket by the
+	 *	output filters as they send it, a block at a time
 	 */
-	ic_sock = ap_bfileno(ic_buff,B_RD);
-	rc = ic_select(ic_sock,0,IC_DEFAULT_TIMEOUT,0);
-	if (rc < 0){
-		ap_log_reason("Failed to select the response header",r->uri,r);
-		return HTTP_INTERNAL_SERVER_ERROR;
-	}
+	bb = apr_brigade_create(r->pool,c->bucket_alloc);
+	APR_BRIGADE_INSERT_TAIL(bb,apr_bucket_socket_create(ic_sock,c->bucket_alloc));
+	APR_BRIGADE_INSERT_TAIL(bb,apr_bucket_eos_create(c->bucket_alloc));
+	return ic_relay_response(r,bb,sock_rec,timing);
+}
+
+/*
+ *	ic_relay_response()
+ *	-------------------
+ *	Relay a response, from the Interchange server or the page cache,
+ *	to the client, ceasing to count the request against the server,
+ *	if any, once it has been read
+ */
+static int ic_relay_response(request_rec *r,apr_bucket_brigade *bb,ic_socket_rec *sock_rec,ic_timing_rec *timing)
+{
+	apr_status_t rv;
+	const char *location;
+	int rc;
+	char sbuf[MAX_STRING_LEN];
 
 	/*
 	 *	check the HTTP header to make sure that it looks valid
 	 */
-	if ((rc = ap_scan_script_header_err_buff(r,ic_buff,sbuf)) != OK) {
-		if (rc == HTTP_INTERNAL_SERVER_ERROR) {
-			ap_log_rerror(APLOG_MARK,APLOG_ERR|APLOG_NOERRNO,r,"Malformed header return by Interchange: %s",sbuf);
+	rc = ap_scan_script_header_err_brigade_ex(r,bb,sbuf,APLOG_MODULE_INDEX);
+	ic_timing_phase(timing,LINK_PHASE_WAIT);
+	if (timing)
+		timing->status = rc == OK ? r->status : rc;
+	if (rc != OK){
+		if (rc == HTTP_INTERNAL_SERVER_ERROR){
+			ap_log_rerror(APLOG_MARK,APLOG_ERR,0,r,"Malformed header return by Interchange: %s",sbuf);
 		}
+		ic_discard_response(bb);
+		ic_finished(r,sock_rec,timing);
 		return rc;
 	}
 
 	/*
 	 *	check the header for an HTTP redirect request
 	 */
-	location = ap_table_get(r->headers_out,"Location");
-	if (r->status == 200 && location){
-		fd_set sock_set;
+	location = apr_table_get(r->headers_out,"Location");
+	if (r->status == HTTP_OK && location){
+		/*
+		 *	soak up any body-text sent by the Interchange server
+		 *
+		 *	the server is done with, and the redirect may well
+		 *	come back here
+		 */
+		ic_discard_response(bb);
+		ic_finished(r,sock_rec,timing);
 
 		/*
 		 *	check if we need to do an external redirect
 		 */
 		if (*location != '/')
-			return REDIRECT;
+			return HTTP_MOVED_TEMPORARILY;
 
 		/*
 		 *	we are here because we need to do an internal redirect
 		 *
-		 *	soak up any data from the Interchange socket
-		 */
-		rc = ic_select(ic_sock,0,IC_DEFAULT_TIMEOUT,0);
-		if (rc < 0){
-			ap_log_reason("Failed to select the response text",r->uri,r);
-			return HTTP_INTERNAL_SERVER_ERROR;
-		}
-
-		/*
-		 *	soak up any body-text sent by the Interchange server
-		 */
-		ap_soft_timeout("mod_interchange: Interchange read",r);
-		while (ap_bgets(argsbuffer,MAX_STRING_LEN,ic_buff) > 0)
-			;
-		ap_kill_timeout(r);
-
-		/*
 		 *	always use the GET method for internal redirects
 		 *	also, unset the Content-Length so that nothing
 		 *	else tries to re-read the text we just soaked up
 		 */
-		r->method = ap_pstrdup(r->pool,"GET");
+		r->method = "GET";
 		r->method_number = M_GET;
-		ap_table_unset(r->headers_in,"Content-Length");
-		ap_internal_redirect(location,r);
+		apr_table_unset(r->headers_in,"Content-Length");
+		ap_internal_redirect_handler(location,r);
 		return OK;
 	}
 
 	/*
-	 *	we were not redirected, so send the HTTP headers
-	 *	to the client
+	 *	we were not redirected, so pass the rest of the response
+	 *	to the client; the headers go out ahead of it
 	 */
-	ap_hard_timeout("mod_interchange: Client write",r);
-	ap_send_http_header(r);
-	if (ap_rflush(r) < 0){
-		ap_log_reason("error sending headers to client",r->uri,r);
-		return HTTP_INTERNAL_SERVER_ERROR;
+	rv = ap_pass_brigade(r->output_filters,bb);
+	ic_finished(r,sock_rec,timing);
+	if (rv != APR_SUCCESS){
+		ap_log_rerror(APLOG_MARK,APLOG_INFO,rv,r,"mod_interchange: error sending response body to client: %s",r->uri);
+		return AP_FILTER_ERROR;
 	}
-
-	/*
-	 *	if Interchange is sending body text (HTML), then
-	 *	relay this to the client
-	 */
-	if (!r->header_only){
-		ap_reset_timeout(r);
-		if ((rc = ap_bnonblock(ic_buff,B_RD)) != 0){
-			ap_log_reason("error turning non blocking I/O on Interchange socket",r->uri,r);
-			return HTTP_INTERNAL_SERVER_ERROR;
-		}
-		ap_bsetflag(ic_buff,B_SAFEREAD,1);
-		if (ap_send_fb(ic_buff,r) <= 0){
-			ap_log_reason("error sending response body to client",r->uri,r);
-			return HTTP_INTERNAL_SERVER_ERROR;
-		}
-	}
-	ap_kill_timeout(r);
 	return OK;
 }
 
@@ -829,13 +2397,23 @@ static int ic_transfer_response(request_rec *r,BUFF *ic_buff)
 static int ic_handler(request_rec *r)
 {
 	ic_conf_rec *conf_rec;
-	BUFF *ic_buff;
+	ic_socket_rec *sock_rec = NULL;
+	apr_socket_t *ic_sock;
+	ic_cache_fill fill,*fillp = NULL;
+	ic_timing_rec *timing = NULL;
+	apr_bucket_brigade *bb;
+	char *data;
+	apr_size_t len;
+	long long start;
 	int i,rc;
 
+	if (!r->handler || strcmp(r->handler,"interchange-handler"))
+		return DECLINED;
+
 	if (r->method_number == M_OPTIONS){
-		r->allowed |= (1 << M_GET);
-		r->allowed |= (1 << M_PUT);
-		r->allowed |= (1 << M_POST);
+		r->allowed |= (AP_METHOD_BIT << M_GET);
+		r->allowed |= (AP_METHOD_BIT << M_PUT);
+		r->allowed |= (AP_METHOD_BIT << M_POST);
 		return DECLINED;
 	}
 
@@ -847,7 +2425,7 @@ static int ic_handler(request_rec *r)
 	 */
 	conf_rec = (ic_conf_rec *)ap_get_module_config(r->per_dir_config,&interchange_module);
 	if (!conf_rec){
-		ap_log_reason("interchange-handler not configured properly",r->uri,r);
+		ic_log_reason("interchange-handler not configured properly",r);
 		return HTTP_INTERNAL_SERVER_ERROR;
 	}
 
@@ -870,132 +2448,174 @@ static int ic_handler(request_rec *r)
 	 */
 	for (i = 0; i < conf_rec->droplist_no; i++){
 		if (strstr(r->uri,conf_rec->droplist[i])){
-			ap_log_reason("interchange-handler match found in the drop list",r->uri,r);
-			ap_log_rerror(APLOG_MARK,APLOG_ERR|APLOG_NOERRNO,r,"Requested URI (%s) matches drop list entry (%s)",r->uri,conf_rec->droplist[i]);
+			ic_log_reason("interchange-handler match found in the drop list",r);
+			ap_log_rerror(APLOG_MARK,APLOG_ERR,0,r,"Requested URI (%s) matches drop list entry (%s)",r->uri,conf_rec->droplist[i]);
 			return HTTP_NOT_FOUND;
 		}
 	}
 
+	/*
+	 *	answer from the page cache if we can, or find out if this
+	 *	request is to get the page for it
+	 */
+	if (ic_cacheable(r,conf_rec) && (fill.cache = ic_cache(conf_rec))){
+		fill.key = ic_cache_key(r,conf_rec);
+		fill.keylen = strlen(fill.key);
+		switch (link_cache_get(fill.cache,fill.key,fill.keylen,&data,&len,conf_rec->cache_wait)){
+		case LINK_CACHE_HIT:
+			bb = apr_brigade_create(r->pool,r->connection->bucket_alloc);
+			APR_BRIGADE_INSERT_TAIL(bb,apr_bucket_heap_create(data,len,free,r->connection->bucket_alloc));
+			APR_BRIGADE_INSERT_TAIL(bb,apr_bucket_eos_create(r->connection->bucket_alloc));
+			return ic_relay_response(r,bb,NULL,NULL);
+		case LINK_CACHE_FILL:
+			fillp = &fill;
+			break;
+		}
+	}
+
 	/*
 	 *	connect to the Interchange server
 	 */
-	ic_buff = ic_connect(r,conf_rec);
-	if (!ic_buff)
-		return HTTP_INTERNAL_SERVER_ERROR;
+	start = link_now_us();
+	ic_sock = ic_connect(r,conf_rec,&sock_rec);
+	if (!ic_sock){
+		if (fillp)
+			link_cache_abandon(fill.cache,fill.key,fill.keylen);
+		return HTTP_SERVICE_UNAVAILABLE;
+	}
+	timing = ic_timing_begin(r,conf_rec,sock_rec,start);
 
 	/*
 	 *	send the client's request to Interchange
 	 */
-	rc = ic_send_request(r,conf_rec,ic_buff);
+	rc = ic_send_request(r,conf_rec,ic_sock);
+	ic_timing_phase(timing,LINK_PHASE_SEND);
+	if (rc != OK && fillp)
+		link_cache_abandon(fill.cache,fill.key,fill.keylen);
 
 	/*
 	 *	receive the response from the Interchange server
 	 *	and relay that response to the client
+	 *
+	 *	the Interchange socket is closed along with the request
 	 */
 	if (rc == OK)
-		rc = ic_transfer_response(r,ic_buff);
-
-	/*
-	 *	close the Interchange socket and return
-	 */
-	ap_bclose(ic_buff);
+		rc = ic_transfer_response(r,conf_rec,ic_sock,sock_rec,fillp,timing);
 	return rc;
 }
 
 /*
- *	the module's configuration directives
+ *	ic_status_put()
+ *	---------------
+ *	Send a line of the timings report to the client
  */
-static command_rec ic_cmds[] = {
-	{
-		"InterchangeServer",	/* directive name */
-		ic_server_cmd,		/* config action routine */
-		NULL,			/* argument to include in call */
-		ACCESS_CONF,		/* where available */
-		TAKE1,			/* arguments */
-		"Address of the primary Interchange server"
-	},
-	{
-		"InterchangeServerBackup",	/* directive name */
-		ic_serverbackup_cmd,		/* config action routine */
-		NULL,			/* argument to include in call */
-		ACCESS_CONF,		/* where available */
-		TAKE1,			/* arguments */
-		"Address of the backup Interchange server"
-	},
-	{
-		"ConnectTries",		/* directive name */
-		ic_connecttries_cmd,	/* config action routine */
-		NULL,			/* argument to include in call */
-		ACCESS_CONF,		/* where available */
-		TAKE1,			/* arguments */
-		"The number of connection attempts to make before giving up"
-	},
-	{
-		"ConnectRetryDelay",	/* directive name */
-		ic_connectretrydelay_cmd, /* config action routine */
-		NULL,			/* argument to include in call */
-		ACCESS_CONF,		/* where available */
-		TAKE1,			/* arguments */
-		"The number of connection attempts to make before giving up"
-	},
-	{
-		"DropRequestList",	/* directive name */
-		ic_droprequestlist_cmd,	/* config action routine */
-		NULL,			/* argument to include in call */
-		ACCESS_CONF,		/* where available */
-		ITERATE,		/* arguments */
-		"Drop the request if the URI path contains one of the specified values"
-	},
-	{
-		"OrdinaryFileList",	/* directive name */
-		ic_ordinaryfilelist_cmd,/* config action routine */
-		NULL,			/* argument to include in call */
-		ACCESS_CONF,		/* where available */
-		ITERATE,		/* arguments */
-		"Don't pass to Interchange if the URI path starts with one of the specified values"
-	},
-	{
-		"InterchangeScript",	/* directive name */
-		ic_interchangescript_cmd, /* config action routine */
-		NULL,			/* argument to include in call */
-		ACCESS_CONF,		/* where available */
-		TAKE1,			/* arguments */
-		"Replace the 'script name' with this value before calling Interchange"
-	},
-	{NULL}
-};
+static void ic_status_put(const char *line,void *arg)
+{
+	ap_rputs(line,(request_rec *)arg);
+}
+
+/*
+ *	ic_status_handler()
+ *	-------------------
+ *	Report the requests each server has in hand and the timings
+ *	kept in the InterchangeStats file, as plain text
+ */
+static int ic_status_handler(request_rec *r)
+{
+	ic_conf_rec *conf_rec;
+	ic_slot_rec *slot;
+
+	if (!r->handler || strcmp(r->handler,"interchange-status"))
+		return DECLINED;
+	if (r->method_number != M_GET)
+		return HTTP_METHOD_NOT_ALLOWED;
+
+	conf_rec = (ic_conf_rec *)ap_get_module_config(r->per_dir_config,&interchange_module);
+	if (!conf_rec || !conf_rec->stats_file){
+		ic_log_reason("interchange-status needs an InterchangeStats file",r);
+		return HTTP_NOT_FOUND;
+	}
+
+	ap_set_content_type(r,"text/plain");
+	if (r->header_only)
+		return OK;
+
+	/*
+	 *	the counts this Apache keeps, then those shared with the links
+	 */
+	for (slot = ic_slots; slot; slot = slot->next)
+		ap_rprintf(r,"active %s %u%s\n",slot->sock_rec->address,
+			apr_atomic_read32(&ic_stats[slot->slot].active),
+			apr_atomic_read32(&ic_stats[slot->slot].down) ? " (down)" : "");
+	if (link_stats_report(conf_rec->stats_file,ic_status_put,r) < 0)
+		ap_rprintf(r,"no timings in %s yet\n",conf_rec->stats_file);
+	return OK;
+}
 
 /*
- *	make the name of the content handler known to Apache
+ *	the module's configuration directives
  */
-static handler_rec ic_handlers[] = {
-	{"interchange-handler",ic_handler},
+static const command_rec ic_cmds[] = {
+	AP_INIT_TAKE123("InterchangeServer",ic_server_cmd,NULL,ACCESS_CONF,
+		"Address of a primary Interchange server, optionally followed by weight=N and max=N"),
+	AP_INIT_TAKE123("InterchangeServerBackup",ic_serverbackup_cmd,NULL,ACCESS_CONF,
+		"Address of a backup Interchange server, optionally followed by weight=N and max=N"),
+	AP_INIT_TAKE1("ConnectTries",ic_connecttries_cmd,NULL,ACCESS_CONF,
+		"The number of connection attempts to make before giving up"),
+	AP_INIT_TAKE1("ConnectRetryDelay",ic_connectretrydelay_cmd,NULL,ACCESS_CONF,
+		"Longest delay, in seconds, between connection attempts"),
+	AP_INIT_TAKE1("ConnectTimeout",ic_connecttimeout_cmd,NULL,ACCESS_CONF,
+		"Milliseconds to wait for each connection to Interchange"),
+	AP_INIT_TAKE123("InterchangeBreaker",ic_breaker_cmd,NULL,ACCESS_CONF,
+		"Circuit breaker file shared with the link programs, optionally followed by the failures that open it and its cooldown in milliseconds"),
+	AP_INIT_TAKE1("InterchangeProtocol",ic_protocol_cmd,NULL,ACCESS_CONF,
+		"Link protocol to use: 1 (text) or 2 (binary, Interchange 5.12 and later)"),
+	AP_INIT_TAKE12("InterchangeQueue",ic_queue_cmd,NULL,ACCESS_CONF,
+		"Requests that may wait when every server is at its limit, each holding a worker thread, optionally followed by how long in milliseconds"),
+	AP_INIT_TAKE123("InterchangeProbe",ic_probe_cmd,NULL,ACCESS_CONF,
+		"Page requested to check each server's health, optionally followed by the interval and timeout in milliseconds"),
+	AP_INIT_TAKE123("InterchangeCache",ic_cache_cmd,NULL,ACCESS_CONF,
+		"Page cache file shared with the link programs, optionally followed by its size and the largest page it keeps, in bytes"),
+	AP_INIT_ITERATE("InterchangeCacheKey",ic_cachekey_cmd,NULL,ACCESS_CONF,
+		"Request headers that cached pages vary by"),
+	AP_INIT_ITERATE("InterchangeCacheCookie",ic_cachecookie_cmd,NULL,ACCESS_CONF,
+		"Cookies that keep a request away from the page cache (default MV_SESSION_ID)"),
+	AP_INIT_TAKE1("InterchangeCacheStale",ic_cachestale_cmd,NULL,ACCESS_CONF,
+		"Seconds a cached page may be used past its lifetime while a new copy is got"),
+	AP_INIT_TAKE1("InterchangeCacheWait",ic_cachewait_cmd,NULL,ACCESS_CONF,
+		"Milliseconds to wait for a page that another request is getting for the cache"),
+	AP_INIT_TAKE1("InterchangeStats",ic_stats_cmd,NULL,ACCESS_CONF,
+		"Request timings file shared with the link programs"),
+	AP_INIT_ITERATE("DropRequestList",ic_droprequestlist_cmd,NULL,ACCESS_CONF,
+		"Drop the request if the URI path contains one of the specified values"),
+	AP_INIT_ITERATE("OrdinaryFileList",ic_ordinaryfilelist_cmd,NULL,ACCESS_CONF,
+		"Don't pass to Interchange if the URI path starts with one of the specified values"),
+	AP_INIT_TAKE1("InterchangeScript",ic_interchangescript_cmd,NULL,ACCESS_CONF,
+		"Replace the 'script name' with this value before calling Interchange"),
 	{NULL}
 };
 
 /*
  *	tell Apache what phases of the transaction we handle
  */
-module MODULE_VAR_EXPORT interchange_module = {
-	STANDARD_MODULE_STUFF,
-	ic_initialise,		/* module initialiser                 */
+static void ic_register_hooks(apr_pool_t *p)
+{
+	ap_hook_pre_config(ic_pre_config,NULL,NULL,APR_HOOK_MIDDLE);
+	ap_hook_post_config(ic_initialise,NULL,NULL,APR_HOOK_MIDDLE);
+	ap_hook_child_init(ic_child_init,NULL,NULL,APR_HOOK_MIDDLE);
+	ap_hook_monitor(ic_monitor,NULL,NULL,APR_HOOK_MIDDLE);
+	ap_hook_handler(ic_handler,NULL,NULL,APR_HOOK_MIDDLE);
+	ap_hook_handler(ic_status_handler,NULL,NULL,APR_HOOK_MIDDLE);
+}
+
+module AP_MODULE_DECLARE_DATA interchange_module = {
+	STANDARD20_MODULE_STUFF,
 	ic_create_dir_config,	/* per-directory config creator       */
 	NULL,			/* dir config merger                  */
 	NULL,			/* server config creator              */
 	NULL,			/* server config merger               */
 	ic_cmds,		/* command table                      */
-	ic_handlers,		/* [7]  content handlers              */
-	NULL,			/* [2]  URI-to-filename translation   */
-	NULL,			/* [5]  check/validate user_id        */
-	NULL,			/* [6]  check user_id is valid *here* */
-	NULL,			/* [4]  check access by host address  */
-	NULL,			/* [7]  MIME type checker/setter      */
-	NULL,			/* [8]  fixups                        */
-	NULL,			/* [9]  logger                        */
-	NULL,			/* [3]  header parser                 */
-	NULL,			/* process initialization             */
-	NULL,			/* process exit/cleanup               */
-	NULL			/* [1]  post read_request handling    */
+	ic_register_hooks	/* register hooks                     */
 };
 
 /*
@@ -1136,11 +1136,80 @@ sub http_soap {
 	return $ref;
 }
 
+# Binary link protocol: a preamble of "\0ICL" and a version byte, then
+# frames of a type byte and a 32-bit big-endian payload length.
+#
+#   A  arguments, each a 32-bit length and the string
+#   E  environment, each a length-prefixed name then value
+#   B  entity, as is
+#   Z  end of request, no payload
+#
+# Links that can't send it keep to the text format handled by
+# read_cgi_data(), which recognizes the leading NUL.
+
+use constant LINK_PREAMBLE => "\0ICL";
+use constant LINK_PROTOCOL => 2;
+
+sub read_cgi_frames {
+    my ($argv, $env, $entity, $in) = @_;
+
+    _read($in) while length($$in) < 5;
+    die "Unrecognized link preamble\n"
+        unless substr($$in, 0, 4) eq LINK_PREAMBLE;
+    my $version = ord(substr($$in, 4, 1));
+    die "Unsupported link protocol version $version\n"
+        unless $version == LINK_PROTOCOL;
+
+    # Walk the buffer by offset rather than chopping frames off the
+    # front of it, which would copy what follows each time.
+    my $pos = 5;
+    for (;;) {
+        _read($in) while length($$in) < $pos + 5;
+        my ($type, $len) = unpack('a N', substr($$in, $pos, 5));
+        $pos += 5;
+
+        if ($type eq 'B' and length($$in) < $pos + $len) {
+            # Read the rest of a large body straight into place rather
+            # than through the buffer, handing back anything read past
+            # its end.
+            $$entity = substr($$in, $pos);
+            _read($entity) while length($$entity) < $len;
+            $$in = substr($$entity, $len, length($$entity) - $len, '');
+            $pos = 0;
+            next;
+        }
+
+        _read($in) while length($$in) < $pos + $len;
+        if ($type eq 'E') {
+            my %block = unpack('(N/a* N/a*)*', substr($$in, $pos, $len));
+            @$env{keys %block} = values %block;
+        }
+        elsif ($type eq 'B') {
+            $$entity = substr($$in, $pos, $len);
+        }
+        elsif ($type eq 'A') {
+            @$argv = unpack('(N/a*)*', substr($$in, $pos, $len));
+        }
+        elsif ($type eq 'Z') {
+            last;
+        }
+        else {
+            die "Unrecognized frame: " . ord($type) . "\n";
+        }
+        $pos += $len;
+    }
+    return 1;
+}
+
 sub read_cgi_data {
     my ($argv, $env, $entity) = @_;
     my ($in, $block, $n, $i, $e, $key, $value);
     $in = '';
 
+    _read(\$in);
+    return read_cgi_frames($argv, $env, $entity, \$in)
+        if substr($in, 0, 1) eq "\0";
+
     for (;;) {
         $block = _find(\$in, "\n");
 		if (($n) = ($block =~ m/^env (\d+)$/)) {
@@ -0,0 +1,82 @@
+# -*- cperl -*-
+
+use strict;
+use warnings;
+use lib 'lib';
+use Test::More;
+use File::Temp qw(tempfile);
+use Vend::Server;
+
+my %env = (
+    REQUEST_METHOD => 'POST',
+    PATH_INFO      => '/ord/basket.html',
+    HTTP_COOKIE    => 'MV_SESSION_ID=abc123; a=b=c',
+    EMPTY          => '',
+);
+my @args = ('', 'two words');
+my $body = join '&', map { "mv_order_item=$_" } 1 .. 5000;
+
+sub frame { $_[0] . pack('N', length $_[1]) . $_[1] }
+
+my %request = (
+    text => join('',
+        'arg ' . @args . "\n",
+        (map { length($_) . " $_\n" } @args),
+        'env ' . keys(%env) . "\n",
+        (map { my $s = "$_=$env{$_}"; length($s) . " $s\n" } sort keys %env),
+        "entity\n" . length($body) . " $body\n",
+        "end\n",
+    ),
+    binary => join('',
+        "\0ICL\2",
+        frame('A', pack('(N/a*)*', @args)),
+        frame('E', pack('(N/a* N/a*)*', map { $_, $env{$_} } sort keys %env)),
+        frame('B', $body),
+        frame('Z', ''),
+    ),
+);
+
+sub parse {
+    my ($data) = @_;
+    my ($fh, $file) = tempfile(UNLINK => 1);
+    binmode $fh;
+    print $fh $data;
+    close $fh;
+
+    my (@argv, %got, $entity);
+    open(Vend::Server::MESSAGE, '<', $file) or die "open $file: $!";
+    binmode Vend::Server::MESSAGE;
+    Vend::Server::read_cgi_data(\@argv, \%got, \$entity);
+    close Vend::Server::MESSAGE;
+    return (\@argv, \%got, $entity);
+}
+
+for my $format (sort keys %request) {
+    my ($argv, $got, $entity) = parse($request{$format});
+    is_deeply($argv, \@args, "$format arguments");
+    is_deeply($got, \%env, "$format environment");
+    is($entity, $body, "$format entity");
+}
+
+# A body bigger than a single read is read straight into place, with
+# whatever follows it handed back to the frame parser.
+my $large = 'x' x (3 * 1024 * 1024 + 17);
+my ($argv, $got, $entity) = parse(join '',
+    "\0ICL\2",
+    frame('B', $large),
+    frame('E', pack('(N/a* N/a*)*', AFTER => 'body')),
+    frame('Z', ''),
+);
+ok($entity eq $large, 'large binary entity');
+is_deeply($got, { AFTER => 'body' }, 'frame after large entity');
+
+eval { parse("\0ICL\2" . substr(frame('B', $large), 0, 2 * 1024 * 1024)) };
+like($@, qr/read: closed/, 'truncated large entity rejected');
+
+eval { parse("\0ICL\2" . substr(frame('B', $body), 0, 100)) };
+like($@, qr/read: closed/, 'truncated entity rejected');
+
+eval { parse("\0ICL\3" . frame('Z', '')) };
+like($@, qr/Unsupported link protocol version 3/, 'unknown version rejected');
+
+done_testing();